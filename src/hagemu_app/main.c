@@ -5,6 +5,8 @@
 #include <stdbool.h>
 
 #include "text.h"
+#include "recorder.h"
+#include "save_journal.h"
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -17,6 +19,13 @@
 #define WINDOW_HEIGHT 144 * SCALE_FACTOR
 #define APP_VERSION "0.1"
 #define GB_CLOCK_FREQUENCY (1 << 22)
+#define GB_FRAME_CYCLES 70224
+#define GB_FRAME_NS (SDL_NS_PER_SECOND * GB_FRAME_CYCLES / GB_CLOCK_FREQUENCY)
+// Audio pacing runs the emulator in small slices so the queue never
+// overshoots its target by much
+#define PACING_SLICE_CYCLES (GB_FRAME_CYCLES / 4)
+#define LOW_LATENCY_SLICE_CYCLES (GB_CLOCK_FREQUENCY / 1000)
+#define CYCLES_TO_AUDIO_FRAMES(cycles) (int)((Uint64)BASE_AUDIO_SAMPLE_RATE * (cycles) / GB_CLOCK_FREQUENCY)
 
 // Green color palatte from lighest to darkest
 #define GREEN1 (Color){ 138, 189, 76,  255 }
@@ -24,7 +33,24 @@
 #define GREEN3 (Color){ 48,  102, 87,  255 }
 #define GREEN4 (Color){ 36,  76,  64,  255 }
 
-bool hagemu_app_setup(struct HagemuApp *app) {
+// The core writes the audio into audio_buffer. While recording, it's kept at
+// full volume so the recording gets the core's own samples, and the audio
+// device lowers the volume instead.
+void hagemu_app_set_audio_output(struct HagemuApp *app) {
+	float volume = 0.25f; // Lower the volume (later this will be adjustable)
+	struct HagemuAudioOutput audio_output = {
+		.buffer   = app->audio_buffer,
+		.capacity = AUDIO_TARGET_FRAMES,
+		.format   = SAMPLE_FORMAT_FLOAT32,
+		.gain     = app->recorder ? 1.0f : volume,
+	};
+	hagemu_set_audio_output(&audio_output);
+	if (app->audio_stream)
+		SDL_SetAudioStreamGain(app->audio_stream, app->recorder ? volume : 1.0f);
+}
+
+// pacing is the mode asked for on the command line, or NULL for the default
+bool hagemu_app_setup(struct HagemuApp *app, const char *pacing) {
 	app->gb = hagemu_create();
 	app->state = HAGEMU_NO_ROM;
 	memset(app->audio_buffer, 0, sizeof(app->audio_buffer));
@@ -51,11 +77,6 @@ bool hagemu_app_setup(struct HagemuApp *app) {
 		return false;
 	}
 
-	if (!SDL_SetRenderVSync(app->renderer, 1)) {
-		fprintf(stderr, "Error failed to set vsync: %s\n", SDL_GetError());
-		return false;
-	}
-
 	app->screen_texture = SDL_CreateTexture(app->renderer,
 						SDL_PIXELFORMAT_XBGR8888,
 						SDL_TEXTUREACCESS_STREAMING,
@@ -67,6 +88,12 @@ bool hagemu_app_setup(struct HagemuApp *app) {
 		return false;
 	}
 
+	// The device's own buffer adds to the latency too, and it has to be
+	// chosen before opening the device
+	bool may_pace_by_audio = (pacing == NULL || strcmp(pacing, "audio") == 0);
+	if (app->low_latency && may_pace_by_audio)
+		SDL_SetHint(SDL_HINT_AUDIO_DEVICE_SAMPLE_FRAMES, "128");
+
 	SDL_AudioSpec audio_spec = {
 		.format = SDL_AUDIO_F32,   // 16-bit signed int format
 		.channels = 2,             // Stereo
@@ -79,11 +106,34 @@ bool hagemu_app_setup(struct HagemuApp *app) {
 		NULL,
 		NULL
 		);
-	if (!app->audio_stream) {
-		fprintf(stderr, "Error creating screen texture: %s\n", SDL_GetError());
+	if (app->audio_stream) {
+		SDL_ResumeAudioStreamDevice(app->audio_stream);
+	} else {
+		fprintf(stderr, "Warning: unable to open an audio device: %s\n", SDL_GetError());
+		printf("Continuing without audio\n");
+	}
+
+#ifdef __EMSCRIPTEN__
+	// The browser decides when each frame runs, so there's no waiting here
+	app->pacing = PACING_VSYNC;
+#else
+	app->pacing = app->audio_stream ? PACING_AUDIO : PACING_SLEEP;
+#endif
+	if (pacing && !hagemu_app_set_pacing(app, pacing))
 		return false;
+
+	if (app->low_latency && app->pacing != PACING_AUDIO) {
+		printf("Low latency mode only applies when pacing by the audio device\n");
+		app->low_latency = false;
 	}
-	SDL_ResumeAudioStreamDevice(app->audio_stream);
+	app->audio_target_frames = app->low_latency ? LOW_LATENCY_TARGET_FRAMES : AUDIO_TARGET_FRAMES;
+
+	// Only required when pacing by the display. In low latency mode, waiting
+	// for vsync would hold up the audio for too long.
+	if (!SDL_SetRenderVSync(app->renderer, app->low_latency ? 0 : 1))
+		fprintf(stderr, "Warning: failed to set vsync: %s\n", SDL_GetError());
+
+	hagemu_app_set_audio_output(app);
 
 	if (!text_init(app->renderer)) {
 		fprintf(stderr, "Error initializing font: %s\n", SDL_GetError());
@@ -94,7 +144,16 @@ bool hagemu_app_setup(struct HagemuApp *app) {
 }
 
 void hagemu_save_sram_file(struct HagemuApp *app) {
-	if (hagemu_sram_available()) {
+	if (app->playing_movie)
+		return;
+
+	if (app->sram_mapped) {
+		// The game writes straight into the file, only the RTC needs updating
+		size_t sram_size;
+		hagemu_get_sram(&sram_size);
+	} else if (app->save_journal) {
+		save_journal_save(app->save_journal);
+	} else if (hagemu_sram_available()) {
 		size_t sram_size;
 		const uint8_t *sram = hagemu_get_sram(&sram_size);
 		char *sram_filename = hagemu_file_sram_name(app->rom_filename);
@@ -109,9 +168,17 @@ void hagemu_save_sram_file(struct HagemuApp *app) {
 
 void hagemu_app_cleanup(struct HagemuApp *app) {
 	printf("Cleaning up!\n");
+	hagemu_movie_stop();
 
-	hagemu_save_sram_file(app);
+	if (app->save_journal)
+		hagemu_app_stop_save_journal(app);
+	else
+		hagemu_save_sram_file(app);
 
+	if (app->recorder)
+		recorder_stop(app->recorder);
+	if (app->pacing == PACING_AUDIO)
+		printf("The audio queue ran dry %u times\n", app->audio_underruns);
 	text_cleanup();
 	free(app->rom_filename);
 	SDL_DestroyAudioStream(app->audio_stream);
@@ -127,6 +194,40 @@ void hagemu_app_reset(struct HagemuApp *app, enum GBModel model) {
 	app->smooth_sample_rate_adjust = 1.0;
 	app->smooth_delta_time  = 1.0 / 60.0;
 	app->old_time = SDL_GetPerformanceCounter();
+	app->next_frame_time = SDL_GetTicksNS();
+	app->audio_primed = false;
+}
+
+bool hagemu_app_set_pacing(struct HagemuApp *app, const char *mode) {
+	if (strcmp(mode, "vsync") == 0) {
+		app->pacing = PACING_VSYNC;
+	} else if (strcmp(mode, "audio") == 0) {
+		if (app->audio_stream) {
+			app->pacing = PACING_AUDIO;
+		} else {
+			printf("There's no audio device to pace by. Sleeping between frames instead...\n");
+			app->pacing = PACING_SLEEP;
+		}
+	} else if (strcmp(mode, "sleep") == 0) {
+		app->pacing = PACING_SLEEP;
+	} else {
+		fprintf(stderr, "[ERROR] Unknown pacing mode '%s' (expected vsync, audio, or sleep)\n", mode);
+		return false;
+	}
+	app->next_frame_time = SDL_GetTicksNS();
+	return true;
+}
+
+bool hagemu_app_set_rtc_clock(const char *mode) {
+	if (strcmp(mode, "wall") == 0) {
+		hagemu_set_rtc_clock(CLOCK_SOURCE_WALL, NULL, NULL);
+	} else if (strcmp(mode, "emulated") == 0) {
+		hagemu_set_rtc_clock(CLOCK_SOURCE_EMULATED, NULL, NULL);
+	} else {
+		fprintf(stderr, "[ERROR] Unknown RTC clock '%s' (expected wall or emulated)\n", mode);
+		return false;
+	}
+	return true;
 }
 
 char *hagemu_file_sram_name(const char *rom_name) {
@@ -163,6 +264,29 @@ char *hagemu_file_sram_name(const char *rom_name) {
 	return sram_name;
 }
 
+// Writes the SRAM to its .sav file now, then only the changes every
+// save_interval from then on
+void hagemu_app_start_save_journal(struct HagemuApp *app) {
+	hagemu_app_stop_save_journal(app);
+	if (app->save_interval == 0 || app->sram_mapped || !app->rom_filename || !hagemu_sram_available())
+		return;
+
+	char *sram_filename = hagemu_file_sram_name(app->rom_filename);
+	if (sram_filename == NULL)
+		return;
+	app->save_journal = save_journal_start(sram_filename);
+	app->next_save_time = SDL_GetTicksNS() + app->save_interval;
+	free(sram_filename);
+}
+
+// Saves everything that's left before the SRAM goes away
+void hagemu_app_stop_save_journal(struct HagemuApp *app) {
+	if (app->save_journal) {
+		save_journal_stop(app->save_journal);
+		app->save_journal = NULL;
+	}
+}
+
 bool hagemu_app_load_sram(struct HagemuApp *app, const char* filename) {
 	printf("Loading SRAM data from '%s'\n", filename);
 	size_t sram_size;
@@ -172,10 +296,15 @@ bool hagemu_app_load_sram(struct HagemuApp *app, const char* filename) {
 		return false;
 	}
 
+	// Pick up whatever changes a previous session saved after the file
+	save_journal_replay(filename, sram_data, sram_size);
+
 	bool result = hagemu_set_sram(sram_data, sram_size);
 	if (result) {
+		app->playing_movie = false;
 		app->state = HAGEMU_GAME_RUNNING;
 		hagemu_app_reset(app, app->gb_model);
+		hagemu_app_start_save_journal(app);
 	}
 	SDL_free(sram_data);
 	return result;
@@ -183,14 +312,13 @@ bool hagemu_app_load_sram(struct HagemuApp *app, const char* filename) {
 
 bool hagemu_app_load_rom(struct HagemuApp *app, const char* filename, enum GBModel model) {
 	printf("Loading the rom file '%s'\n", filename);
-	size_t rom_size;
-	uint8_t *rom_data = SDL_LoadFile(filename, &rom_size);
-	if (!rom_data) {
-		fprintf(stderr, "[ERROR] Unable to load file '%s': %s\n", filename, SDL_GetError());
+	struct HagemuRomImage *rom = hagemu_rom_open(filename);
+	if (!rom)
 		return false;
-	}
-	hagemu_set_rom(app->gb, model, rom_data, rom_size);
-	SDL_free(rom_data);
+	hagemu_app_stop_save_journal(app);
+	hagemu_set_rom_image(app->gb, model, rom);
+	app->sram_mapped = false;
+	hagemu_rom_release(rom);
 
 	if (app->rom_filename)
 		free(app->rom_filename);
@@ -205,23 +333,40 @@ bool hagemu_app_load_rom(struct HagemuApp *app, const char* filename, enum GBMod
 	app->gb_model = model;
 	hagemu_app_reset(app, app->gb_model);
 
-	if (!hagemu_sram_available())
+	if (!hagemu_sram_available() || app->playing_movie)
 		return true;
 
 	// Load the SRAM
 	char *sram_file_name = hagemu_file_sram_name(app->rom_filename);
+
+	// A journal left behind by a crash has to be folded into the file first
+	bool journal_pending = save_journal_pending(sram_file_name);
+	if (app->map_sram && !journal_pending && hagemu_map_sram(sram_file_name)) {
+		app->sram_mapped = true;
+		free(sram_file_name);
+		return true;
+	}
+
 	bool sram_file_exists = SDL_GetPathInfo(sram_file_name, NULL);
 	if (sram_file_exists) {
 		hagemu_app_load_sram(app, sram_file_name);
 	} else {
 		printf("Unable to locate an SRAM file '%s'.\n", sram_file_name);
 		printf("Using a blank SRAM file instead...\n");
+		hagemu_app_start_save_journal(app);
+	}
+
+	if (app->map_sram && journal_pending) {
+		hagemu_app_stop_save_journal(app);
+		app->sram_mapped = hagemu_map_sram(sram_file_name);
 	}
 	free(sram_file_name);
 	return true;
 }
 
 void hagemu_quit_rom(struct HagemuApp *app) {
+	hagemu_app_stop_save_journal(app);
+	app->sram_mapped = false;
 	app->state = HAGEMU_NO_ROM;
 	free(app->rom_filename);
 	app->rom_filename = NULL;
@@ -274,6 +419,10 @@ void hagemu_handle_drop_event(struct HagemuApp *app, const char *filename) {
 		return;
 	}
 
+	// A new rom can't be part of the movie
+	if (strcmp(ext, ".gbc") == 0 || strcmp(ext, ".gb") == 0)
+		app->playing_movie = false;
+
 	if (strcmp(ext, ".gbc") == 0)
 		hagemu_app_load_rom(app, filename, true);
 	else if (strcmp(ext, ".gb") == 0)
@@ -323,13 +472,17 @@ void hagemu_handle_events(struct HagemuApp *app) {
 	}
 }
 
-// Calculutes how much the audio should be resampled to meet the target number
-// of frames queued in the SDL_AudioStream.
-int calculate_sample_rate(struct HagemuApp *app) {
+int queued_audio_frames(struct HagemuApp *app) {
 	int queued_bytes = SDL_GetAudioStreamQueued(app->audio_stream);
 	/* if (queued_bytes == 0) */
 		/* printf("[DEBUG] Audio buffer is empty\n"); */
-	int queued_frames = queued_bytes / (2 * sizeof(float));
+	return queued_bytes / (2 * sizeof(float));
+}
+
+// Calculutes how much the audio should be resampled to meet the target number
+// of frames queued in the SDL_AudioStream.
+double calculate_rate_ratio(struct HagemuApp *app) {
+	int queued_frames = queued_audio_frames(app);
 	float error = (AUDIO_TARGET_FRAMES - queued_frames) / (double)AUDIO_TARGET_FRAMES;
 	error *= 0.05f;
 	if (error < -0.005f) error = -0.005f;
@@ -337,7 +490,7 @@ int calculate_sample_rate(struct HagemuApp *app) {
 	double new_sample_rate = 1.0 + error;
 	app->smooth_sample_rate_adjust *= 0.95;
 	app->smooth_sample_rate_adjust += 0.05 * new_sample_rate;
-	return BASE_AUDIO_SAMPLE_RATE * app->smooth_sample_rate_adjust;
+	return app->smooth_sample_rate_adjust;
 }
 
 double get_smooth_delta_time(struct HagemuApp *app) {
@@ -379,6 +532,94 @@ void hagemu_no_rom_screen(struct HagemuApp *app) {
 	SDL_RenderPresent(app->renderer);
 }
 
+void run_cycles(struct HagemuApp *app, int cycles) {
+	while (cycles > 0) {
+		cycles -= hagemu_next_instruction(app->gb);
+		// Catch every completed frame, even when several finish in one loop
+		if (app->recorder && hagemu_get_frame_count() != app->last_recorded_frame) {
+			app->last_recorded_frame = hagemu_get_frame_count();
+			recorder_push_frame(app->recorder, hagemu_get_framebuffer());
+		}
+	}
+}
+
+// Sends the audio made since the last call to the audio device
+int push_audio(struct HagemuApp *app) {
+	int frames = hagemu_take_audio_output();
+	if (app->recorder)
+		recorder_push_audio(app->recorder, app->audio_buffer, frames);
+	if (app->audio_stream)
+		SDL_PutAudioStreamData(app->audio_stream, app->audio_buffer, 2 * sizeof(float) * frames);
+	return frames;
+}
+
+// Runs as long as the last frame took, then resamples the audio to keep the
+// queue from drifting. While recording, the core keeps making audio at the
+// normal rate and the audio device resamples it instead, so the recording
+// isn't resampled. A higher ratio makes the core produce more audio, but makes
+// the device consume it faster, so the device gets the inverse.
+void run_vsync_paced(struct HagemuApp *app) {
+	double smooth_delta_time = get_smooth_delta_time(app);
+	run_cycles(app, smooth_delta_time * GB_CLOCK_FREQUENCY);
+
+	double rate_ratio = calculate_rate_ratio(app);
+	if (app->recorder) {
+		hagemu_set_audio_rate_ratio(1.0);
+		if (app->audio_stream)
+			SDL_SetAudioStreamFrequencyRatio(app->audio_stream, 1.0 / rate_ratio);
+	} else {
+		hagemu_set_audio_rate_ratio(rate_ratio);
+	}
+	push_audio(app);
+}
+
+// The audio device plays at exactly the right speed, so emulating just enough
+// to keep its queue full runs the GameBoy at the right speed too. There's no
+// drift to correct, so the audio is never resampled.
+void run_audio_paced(struct HagemuApp *app) {
+	hagemu_set_audio_rate_ratio(1.0);
+
+	// Low latency mode pushes each millisecond of audio as soon as it's made
+	int slice_cycles = app->low_latency ? LOW_LATENCY_SLICE_CYCLES : PACING_SLICE_CYCLES;
+	int slice_frames = CYCLES_TO_AUDIO_FRAMES(slice_cycles);
+
+	// Keep going until there's a new frame to show. The LCD might be off,
+	// so give up after a frame's worth of cycles.
+	unsigned frame_count = hagemu_get_frame_count();
+	int cycles = 0;
+	while (cycles < GB_FRAME_CYCLES && hagemu_get_frame_count() == frame_count) {
+		// Wait for room for another slice
+		int excess = queued_audio_frames(app) + slice_frames - app->audio_target_frames;
+		if (excess > 0)
+			SDL_DelayPrecise(SDL_NS_PER_SECOND * excess / BASE_AUDIO_SAMPLE_RATE);
+
+		int queued = queued_audio_frames(app);
+		if (queued == 0 && app->audio_primed)
+			app->audio_underruns++;
+
+		while (queued < app->audio_target_frames) {
+			run_cycles(app, slice_cycles);
+			cycles += slice_cycles;
+			queued += push_audio(app);
+			app->audio_primed = true;
+		}
+	}
+}
+
+// Without audio, the emulator runs a frame at a time and sleeps until the
+// next one is due
+void run_sleep_paced(struct HagemuApp *app) {
+	Uint64 now = SDL_GetTicksNS();
+	if (now < app->next_frame_time)
+		SDL_DelayPrecise(app->next_frame_time - now);
+	else if (now - app->next_frame_time > 5 * GB_FRAME_NS)
+		app->next_frame_time = now; // Too far behind to catch up
+
+	run_cycles(app, GB_FRAME_CYCLES);
+	push_audio(app);
+	app->next_frame_time += GB_FRAME_NS;
+}
+
 void main_loop(void* arg) {
 	struct HagemuApp *app = (struct HagemuApp *)arg;
 	hagemu_handle_events(app);
@@ -388,27 +629,29 @@ void main_loop(void* arg) {
 		return;
 	}
 
-	double smooth_delta_time = get_smooth_delta_time(app);
-	int cycles = smooth_delta_time * GB_CLOCK_FREQUENCY;
-	while (cycles > 0)
-		cycles -= hagemu_next_instruction(app->gb);
+	switch (app->pacing) {
+	case PACING_VSYNC: run_vsync_paced(app); break;
+	case PACING_AUDIO: run_audio_paced(app); break;
+	case PACING_SLEEP: run_sleep_paced(app); break;
+	}
+
+	Uint64 now = SDL_GetTicksNS();
+	if (app->save_journal && now >= app->next_save_time) {
+#ifdef __EMSCRIPTEN__
+		// The journal is only in memory until it's synced to IndexedDB
+		if (save_journal_flush(app->save_journal))
+			web_sync_files();
+#else
+		save_journal_flush(app->save_journal);
+#endif
+		app->next_save_time = now + app->save_interval;
+	}
 
 	// Even if there's not a new frame, updating the texture every loop
 	// iteration makes the workload smoother and more consistent
 	SDL_UpdateTexture(app->screen_texture, NULL, hagemu_get_framebuffer(), sizeof(uint32_t) * 160);
 	SDL_RenderTexture(app->renderer, app->screen_texture, NULL, NULL);
 	SDL_RenderPresent(app->renderer);
-
-	int sample_rate = calculate_sample_rate(app);
-	hagemu_set_audio_sample_rate(sample_rate);
-	int frames_available = hagemu_audio_available();
-	if (frames_available > AUDIO_TARGET_FRAMES)
-		frames_available = AUDIO_TARGET_FRAMES;
-	int frames = hagemu_audio_read(app->audio_buffer, frames_available);
-	// Lower the volume (later this will be adjustable)
-	for (int i = 0; i < 2 * frames; i++)
-		app->audio_buffer[i] /= 4.0;
-	SDL_PutAudioStreamData(app->audio_stream, app->audio_buffer, 2 * sizeof(float) * frames);
 }
 
 bool is_gbc_file(const char *filename) {
@@ -420,8 +663,42 @@ bool is_gbc_file(const char *filename) {
 }
 
 int main(int argc, char *argv[]) {
-	struct HagemuApp app = { 0 };
-	hagemu_app_setup(&app);
+	struct HagemuApp app = { .save_interval = SDL_NS_PER_SECOND };
+
+	const char *rom_filename = NULL;
+	const char *record_name = NULL;
+	const char *pacing = NULL;
+	const char *rtc_clock = NULL;
+	const char *movie_record = NULL;
+	const char *movie_play = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_name = argv[++i];
+		} else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+			pacing = argv[++i];
+		} else if (strcmp(argv[i], "--low-latency") == 0) {
+			app.low_latency = true;
+		} else if (strcmp(argv[i], "--rtc-clock") == 0 && i + 1 < argc) {
+			rtc_clock = argv[++i];
+		} else if (strcmp(argv[i], "--movie-record") == 0 && i + 1 < argc) {
+			movie_record = argv[++i];
+		} else if (strcmp(argv[i], "--movie-play") == 0 && i + 1 < argc) {
+			movie_play = argv[++i];
+		} else if (strcmp(argv[i], "--map-sram") == 0) {
+			app.map_sram = true;
+		} else if (strcmp(argv[i], "--save-interval") == 0 && i + 1 < argc) {
+			// In seconds, 0 only saves on exit
+			app.save_interval = SDL_strtod(argv[++i], NULL) * SDL_NS_PER_SECOND;
+		} else if (rom_filename == NULL) {
+			rom_filename = argv[i];
+		} else {
+			fprintf(stderr, "Error: Too many arguments\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!hagemu_app_setup(&app, pacing))
+		exit(EXIT_FAILURE);
 
 #ifdef __EMSCRIPTEN__
 	web_save_pointer_for_javascript(&app);
@@ -430,11 +707,20 @@ int main(int argc, char *argv[]) {
 	printf("Application started successfully\n");
 	printf("Waiting for a rom file\n");
 
-	if (argc == 2) {
-		hagemu_app_load_rom(&app, argv[1], is_gbc_file(argv[1]));
-	} else if (argc > 2) {
-		fprintf(stderr, "Error: Too many arguments\n");
+	if (rtc_clock && !hagemu_app_set_rtc_clock(rtc_clock))
+		exit(EXIT_FAILURE);
+
+	app.playing_movie = (rom_filename && movie_play);
+	if (rom_filename)
+		hagemu_app_load_rom(&app, rom_filename, is_gbc_file(rom_filename));
+	if (rom_filename && movie_record && !hagemu_movie_record(app.gb, movie_record, 0))
+		exit(EXIT_FAILURE);
+	if (app.playing_movie && !hagemu_movie_play(app.gb, movie_play))
 		exit(EXIT_FAILURE);
+	if (rom_filename && record_name) {
+		app.recorder = recorder_start(record_name, BASE_AUDIO_SAMPLE_RATE);
+		app.last_recorded_frame = hagemu_get_frame_count();
+		hagemu_app_set_audio_output(&app);
 	}
 
 #ifdef __EMSCRIPTEN__
@@ -3,10 +3,21 @@
 
 #define BASE_AUDIO_SAMPLE_RATE 48000
 #define AUDIO_TARGET_FRAMES 4096
+#define LOW_LATENCY_TARGET_FRAMES 480 // 10 ms
 
 #include <SDL3/SDL.h>
 #include "hagemu_core.h"
 
+struct Recorder;
+struct SaveJournal;
+
+// What decides how fast the emulator runs
+enum PacingMode {
+	PACING_VSYNC, // Run for as long as the last frame took to display
+	PACING_AUDIO, // Run until the audio device has enough queued
+	PACING_SLEEP, // Run a frame at a time and sleep until the next is due
+};
+
 enum AppState {
 	HAGEMU_NO_ROM,
 	HAGEMU_PAUSE_MENU,
@@ -27,14 +38,33 @@ struct HagemuApp {
 	Uint64 old_time;
 	double smooth_delta_time;
 	double smooth_sample_rate_adjust;
+	enum PacingMode pacing;
+	Uint64 next_frame_time; // Only used when sleeping between frames
+	bool low_latency;
+	int audio_target_frames; // How much audio to keep queued
+	bool audio_primed;       // Whether any audio has been queued yet
+	unsigned audio_underruns;
 	enum AppState state;
 	char *rom_filename;
+	struct Recorder *recorder; // NULL unless recording
+	unsigned last_recorded_frame;
+	struct SaveJournal *save_journal; // NULL if the SRAM is only saved on exit
+	Uint64 save_interval;  // In nanoseconds, 0 turns the journal off
+	Uint64 next_save_time;
+	bool map_sram;    // Use the .sav file itself as the cartridge RAM if possible
+	bool sram_mapped; // Whether that worked for the current rom
+	bool playing_movie; // The movie brings its own SRAM, so the .sav is left alone
 };
 
 bool hagemu_app_load_rom(struct HagemuApp *app, const char *filename, enum GBModel model);
 bool hagemu_app_load_sram(struct HagemuApp *app, const char *filename);
 void hagemu_app_reset(struct HagemuApp *app, enum GBModel model);
+void hagemu_app_set_audio_output(struct HagemuApp *app);
+bool hagemu_app_set_pacing(struct HagemuApp *app, const char *mode);
+bool hagemu_app_set_rtc_clock(const char *mode);
 void hagemu_save_sram_file(struct HagemuApp *app);
+void hagemu_app_start_save_journal(struct HagemuApp *app);
+void hagemu_app_stop_save_journal(struct HagemuApp *app);
 char *hagemu_file_sram_name(const char *rom_name);
 void hagemu_quit_rom(struct HagemuApp *app);
 
@@ -0,0 +1,302 @@
+#include "recorder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// About half a second of video. Audio blocks share the same slots.
+#define RECORDER_QUEUE_SIZE 32
+
+// The GameBoy draws a frame every 70224 cycles of its 4 MiHz clock
+#define Y4M_HEADER "YUV4MPEG2 W160 H144 F4194304:70224 Ip A1:1 C444 XCOLORRANGE=LIMITED\n"
+#define WAV_HEADER_SIZE 44
+
+enum RecorderItemType {
+	ITEM_FRAME,
+	ITEM_AUDIO,
+};
+
+struct RecorderItem {
+	enum RecorderItemType type;
+	unsigned audio_frames;
+	unsigned silent_frames; // Written before the samples in place of dropped audio
+	unsigned repeat_frames; // Copies of the previous frame written in place of dropped ones
+	union {
+		uint32_t pixels[160 * 144];
+		float samples[2 * AUDIO_TARGET_FRAMES];
+	} data;
+};
+
+struct Recorder {
+	SDL_IOStream *video_file;
+	SDL_IOStream *audio_file;
+	int sample_rate;
+	uint32_t audio_bytes_written;
+	unsigned video_frames_written;
+
+	SDL_Thread *writer;
+	SDL_Mutex *lock;
+	SDL_Condition *items_ready;
+	bool stopping;
+
+	// Only the emulation thread moves the head and only the writer moves
+	// the tail, so each side owns the items that it's working on
+	struct RecorderItem items[RECORDER_QUEUE_SIZE];
+	unsigned head;
+	unsigned tail;
+	unsigned count;
+
+	unsigned dropped_frames;
+	unsigned dropped_audio;
+	unsigned silent_frames; // Dropped since the last block that made it in
+	unsigned repeat_frames; // Dropped since the last frame that made it in
+};
+
+static void put_u16(uint8_t *out, uint16_t value) {
+	out[0] = value & 0xFF;
+	out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+	put_u16(out, value & 0xFFFF);
+	put_u16(out + 2, value >> 16);
+}
+
+// 16-bit stereo PCM. The sizes are filled in when the recording stops.
+static void write_wav_header(struct Recorder *recorder) {
+	uint8_t header[WAV_HEADER_SIZE];
+	memcpy(header, "RIFF", 4);
+	put_u32(header + 4, 36 + recorder->audio_bytes_written);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_u32(header + 16, 16);                              // fmt chunk size
+	put_u16(header + 20, 1);                               // PCM
+	put_u16(header + 22, 2);                               // channels
+	put_u32(header + 24, recorder->sample_rate);
+	put_u32(header + 28, recorder->sample_rate * 2 * sizeof(int16_t));
+	put_u16(header + 32, 2 * sizeof(int16_t));             // block align
+	put_u16(header + 34, 16);                              // bits per sample
+	memcpy(header + 36, "data", 4);
+	put_u32(header + 40, recorder->audio_bytes_written);
+	SDL_WriteIO(recorder->audio_file, header, sizeof(header));
+}
+
+// The last frame converted, kept to fill in for dropped ones
+static uint8_t planes[3][160 * 144];
+
+// Uses the same BT.601 coefficients as the PPU, without chroma subsampling
+static void convert_y4m_frame(const uint32_t *pixels) {
+	for (int i = 0; i < 160 * 144; i++) {
+		int r = (pixels[i] >> 0)  & 0xFF;
+		int g = (pixels[i] >> 8)  & 0xFF;
+		int b = (pixels[i] >> 16) & 0xFF;
+		planes[0][i] = ((  66 * r + 129 * g +  25 * b + 128) >> 8) + 16;
+		planes[1][i] = (( -38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+		planes[2][i] = (( 112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+	}
+}
+
+// The frame rate is fixed, so every dropped frame still has to be written
+// for the video to stay as long as the audio
+static void write_y4m_planes(struct Recorder *recorder, unsigned count) {
+	for (unsigned i = 0; i < count; i++) {
+		SDL_WriteIO(recorder->video_file, "FRAME\n", 6);
+		SDL_WriteIO(recorder->video_file, planes, sizeof(planes));
+	}
+	recorder->video_frames_written += count;
+}
+
+static void write_y4m_frame(struct Recorder *recorder, const uint32_t *pixels, unsigned repeat_frames) {
+	// Frames dropped before the first one are filled in with the first one
+	if (recorder->video_frames_written > 0)
+		write_y4m_planes(recorder, repeat_frames);
+	convert_y4m_frame(pixels);
+	if (recorder->video_frames_written == 0)
+		write_y4m_planes(recorder, repeat_frames);
+	write_y4m_planes(recorder, 1);
+}
+
+static void write_wav_samples(struct Recorder *recorder, const float *samples, unsigned frames) {
+	static uint8_t pcm[2 * AUDIO_TARGET_FRAMES * sizeof(int16_t)];
+	for (unsigned i = 0; i < 2 * frames; i++) {
+		float sample = samples[i];
+		if (sample > 1.0f)  sample = 1.0f;
+		if (sample < -1.0f) sample = -1.0f;
+		put_u16(pcm + 2 * i, (uint16_t)(int16_t)(sample * 32767.0f));
+	}
+	size_t size = 2 * frames * sizeof(int16_t);
+	SDL_WriteIO(recorder->audio_file, pcm, size);
+	recorder->audio_bytes_written += size;
+}
+
+// Keeps the audio as long as the video when blocks had to be dropped
+static void write_wav_silence(struct Recorder *recorder, unsigned frames) {
+	static const float silence[2 * AUDIO_TARGET_FRAMES] = { 0 };
+	while (frames > 0) {
+		unsigned count = frames < AUDIO_TARGET_FRAMES ? frames : AUDIO_TARGET_FRAMES;
+		write_wav_samples(recorder, silence, count);
+		frames -= count;
+	}
+}
+
+static int recorder_writer_thread(void *data) {
+	struct Recorder *recorder = data;
+
+	SDL_LockMutex(recorder->lock);
+	while (true) {
+		while (recorder->count == 0 && !recorder->stopping)
+			SDL_WaitCondition(recorder->items_ready, recorder->lock);
+		if (recorder->count == 0)
+			break;
+		SDL_UnlockMutex(recorder->lock);
+
+		struct RecorderItem *item = &recorder->items[recorder->tail];
+		if (item->type == ITEM_FRAME)
+			write_y4m_frame(recorder, item->data.pixels, item->repeat_frames);
+		else {
+			write_wav_silence(recorder, item->silent_frames);
+			write_wav_samples(recorder, item->data.samples, item->audio_frames);
+		}
+
+		SDL_LockMutex(recorder->lock);
+		recorder->tail = (recorder->tail + 1) % RECORDER_QUEUE_SIZE;
+		recorder->count--;
+	}
+	SDL_UnlockMutex(recorder->lock);
+	return 0;
+}
+
+struct Recorder *recorder_start(const char *basename, int sample_rate) {
+	struct Recorder *recorder = calloc(1, sizeof(struct Recorder));
+	if (recorder == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the recorder\n");
+		return NULL;
+	}
+	recorder->sample_rate = sample_rate;
+
+	size_t name_length = strlen(basename) + strlen(".y4m") + 1;
+	char *filename = malloc(name_length);
+	if (filename == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the recording file names\n");
+		free(recorder);
+		return NULL;
+	}
+
+	snprintf(filename, name_length, "%s.y4m", basename);
+	recorder->video_file = SDL_IOFromFile(filename, "wb");
+	if (!recorder->video_file)
+		fprintf(stderr, "[ERROR] Unable to create file '%s': %s\n", filename, SDL_GetError());
+
+	snprintf(filename, name_length, "%s.wav", basename);
+	recorder->audio_file = SDL_IOFromFile(filename, "wb");
+	if (!recorder->audio_file)
+		fprintf(stderr, "[ERROR] Unable to create file '%s': %s\n", filename, SDL_GetError());
+	free(filename);
+
+	recorder->lock = SDL_CreateMutex();
+	recorder->items_ready = SDL_CreateCondition();
+	if (!recorder->video_file || !recorder->audio_file || !recorder->lock || !recorder->items_ready) {
+		recorder_stop(recorder);
+		return NULL;
+	}
+
+	SDL_WriteIO(recorder->video_file, Y4M_HEADER, strlen(Y4M_HEADER));
+	write_wav_header(recorder);
+
+	recorder->writer = SDL_CreateThread(recorder_writer_thread, "recorder", recorder);
+	if (!recorder->writer) {
+		fprintf(stderr, "[ERROR] Unable to start the recording thread: %s\n", SDL_GetError());
+		recorder_stop(recorder);
+		return NULL;
+	}
+
+	printf("Recording to '%s.y4m' and '%s.wav'\n", basename, basename);
+	return recorder;
+}
+
+void recorder_stop(struct Recorder *recorder) {
+	if (recorder->writer) {
+		SDL_LockMutex(recorder->lock);
+		recorder->stopping = true;
+		SDL_SignalCondition(recorder->items_ready);
+		SDL_UnlockMutex(recorder->lock);
+		SDL_WaitThread(recorder->writer, NULL);
+		if (recorder->audio_file)
+			write_wav_silence(recorder, recorder->silent_frames);
+		if (recorder->video_file && recorder->video_frames_written > 0)
+			write_y4m_planes(recorder, recorder->repeat_frames);
+
+		printf("Recording stopped (%u frames and %u audio blocks dropped)\n",
+		       recorder->dropped_frames, recorder->dropped_audio);
+	}
+
+	if (recorder->audio_file) {
+		// Now that the size is known, go back and fix the header
+		if (recorder->writer && SDL_SeekIO(recorder->audio_file, 0, SDL_IO_SEEK_SET) == 0)
+			write_wav_header(recorder);
+		SDL_CloseIO(recorder->audio_file);
+	}
+	if (recorder->video_file)
+		SDL_CloseIO(recorder->video_file);
+	if (recorder->items_ready)
+		SDL_DestroyCondition(recorder->items_ready);
+	if (recorder->lock)
+		SDL_DestroyMutex(recorder->lock);
+	free(recorder);
+}
+
+// Returns the next free item, or NULL if the writer has fallen behind
+static struct RecorderItem *recorder_claim(struct Recorder *recorder) {
+	SDL_LockMutex(recorder->lock);
+	bool full = (recorder->count == RECORDER_QUEUE_SIZE);
+	SDL_UnlockMutex(recorder->lock);
+	return full ? NULL : &recorder->items[recorder->head];
+}
+
+static void recorder_commit(struct Recorder *recorder) {
+	SDL_LockMutex(recorder->lock);
+	recorder->head = (recorder->head + 1) % RECORDER_QUEUE_SIZE;
+	recorder->count++;
+	SDL_SignalCondition(recorder->items_ready);
+	SDL_UnlockMutex(recorder->lock);
+}
+
+void recorder_push_frame(struct Recorder *recorder, const uint32_t *frame) {
+	struct RecorderItem *item = recorder_claim(recorder);
+	if (item == NULL) {
+		recorder->dropped_frames++;
+		recorder->repeat_frames++;
+		return;
+	}
+	item->type = ITEM_FRAME;
+	item->repeat_frames = recorder->repeat_frames;
+	recorder->repeat_frames = 0;
+	memcpy(item->data.pixels, frame, sizeof(item->data.pixels));
+	recorder_commit(recorder);
+}
+
+void recorder_push_audio(struct Recorder *recorder, const float *samples, unsigned frames) {
+	if (frames == 0)
+		return;
+	if (frames > AUDIO_TARGET_FRAMES)
+		frames = AUDIO_TARGET_FRAMES;
+
+	struct RecorderItem *item = recorder_claim(recorder);
+	if (item == NULL) {
+		recorder->dropped_audio++;
+		recorder->silent_frames += frames;
+		return;
+	}
+	item->type = ITEM_AUDIO;
+	item->audio_frames = frames;
+	item->silent_frames = recorder->silent_frames;
+	recorder->silent_frames = 0;
+	memcpy(item->data.samples, samples, 2 * sizeof(float) * frames);
+	recorder_commit(recorder);
+}
+
+unsigned recorder_dropped_frames(struct Recorder *recorder) {
+	return recorder->dropped_frames;
+}
+
+unsigned recorder_dropped_audio(struct Recorder *recorder) {
+	return recorder->dropped_audio;
+}
@@ -0,0 +1,24 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+
+// Frames and audio are queued here and written to disk by a separate thread,
+// so recording never makes the emulator wait on disk I/O
+struct Recorder;
+
+// Creates <basename>.y4m and <basename>.wav and starts the writer thread
+struct Recorder *recorder_start(const char *basename, int sample_rate);
+// Waits for the writer to finish the queue, then closes both files
+void recorder_stop(struct Recorder *recorder);
+
+// These copy the data into the queue, or drop it if the queue is full
+void recorder_push_frame(struct Recorder *recorder, const uint32_t *frame);
+void recorder_push_audio(struct Recorder *recorder, const float *samples, unsigned frames);
+
+unsigned recorder_dropped_frames(struct Recorder *recorder);
+unsigned recorder_dropped_audio(struct Recorder *recorder);
+
+#endif // RECORDER_H
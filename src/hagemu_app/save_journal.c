@@ -0,0 +1,394 @@
+#include "save_journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+
+// Journal layout (all values are little endian):
+//   char     magic[4] ("HGSJ")
+//   uint32_t sram_size
+//   Records of:
+//     uint32_t page_count
+//     For every page: uint16_t index, then the page (shorter if it's the last)
+//     uint32_t checksum of everything in the record before it
+// A record that's cut short or has the wrong checksum ends the journal.
+#define JOURNAL_MAGIC "HGSJ"
+#define JOURNAL_HEADER_SIZE 8
+#define PAGE_SIZE HAGEMU_SRAM_PAGE_SIZE
+
+// Fold the journal into the .sav once it's this many times the SRAM size
+#define COMPACT_RATIO 4
+
+struct SaveJournal {
+	char *sav_filename;
+	char *journal_filename;
+	size_t size;
+	unsigned page_count;
+
+	// Only touched by the writer
+	SDL_IOStream *file;
+	Uint64 journal_size;
+	uint8_t *shadow; // What the .sav and the journal add up to
+	uint8_t *record;
+
+	// Pages copied from the core that haven't been written yet
+	uint8_t *pending;
+	bool *pending_dirty;
+	unsigned pending_count;
+	bool compact_requested;
+
+	// Without a writer thread the work is done during save_journal_flush
+	SDL_Thread *writer;
+	SDL_Mutex *lock;
+	SDL_Condition *work_ready;
+	SDL_Condition *work_done;
+	bool working;
+	bool stopping;
+	uint16_t *dirty_pages;
+};
+
+static void put_u16(uint8_t *out, uint16_t value) {
+	out[0] = value;
+	out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+	put_u16(out, value);
+	put_u16(out + 2, value >> 16);
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+	return in[0] | (in[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+	return get_u16(in) | ((uint32_t)get_u16(in + 2) << 16);
+}
+
+// FNV-1a
+static uint32_t checksum(const uint8_t *data, size_t size) {
+	uint32_t hash = 0x811C9DC5;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static size_t page_length(size_t size, unsigned page) {
+	size_t start = (size_t)page * PAGE_SIZE;
+	return (size - start < PAGE_SIZE) ? size - start : PAGE_SIZE;
+}
+
+static char *journal_name(const char *sav_filename) {
+	size_t length = strlen(sav_filename);
+	char *name = malloc(length + strlen(".journal") + 1);
+	if (name == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the journal file name\n");
+		return NULL;
+	}
+	memcpy(name, sav_filename, length);
+	strcpy(name + length, ".journal");
+	return name;
+}
+
+bool save_journal_pending(const char *sav_filename) {
+	char *filename = journal_name(sav_filename);
+	SDL_PathInfo info;
+	bool pending = filename != NULL && SDL_GetPathInfo(filename, &info)
+	            && info.size > JOURNAL_HEADER_SIZE;
+	free(filename);
+	return pending;
+}
+
+unsigned save_journal_replay(const char *sav_filename, uint8_t *data, size_t size) {
+	char *filename = journal_name(sav_filename);
+	if (filename == NULL || !SDL_GetPathInfo(filename, NULL)) {
+		free(filename);
+		return 0;
+	}
+
+	size_t journal_size;
+	uint8_t *journal = SDL_LoadFile(filename, &journal_size);
+	if (!journal) {
+		fprintf(stderr, "[ERROR] Unable to load file '%s': %s\n", filename, SDL_GetError());
+		free(filename);
+		return 0;
+	}
+
+	unsigned records = 0;
+	if (journal_size < JOURNAL_HEADER_SIZE
+	    || memcmp(journal, JOURNAL_MAGIC, 4) != 0
+	    || get_u32(journal + 4) != size) {
+		printf("Ignoring the journal '%s', it doesn't match the save file\n", filename);
+		SDL_free(journal);
+		free(filename);
+		return 0;
+	}
+
+	// Check the whole record before applying any of it
+	size_t position = JOURNAL_HEADER_SIZE;
+	unsigned page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	while (journal_size - position >= 8) {
+		const uint8_t *record = journal + position;
+		uint32_t count = get_u32(record);
+		size_t offset = 4;
+		bool valid = (count <= page_count);
+		for (uint32_t i = 0; valid && i < count; i++) {
+			if (position + offset + 2 > journal_size) {
+				valid = false;
+				break;
+			}
+			unsigned page = get_u16(record + offset);
+			valid = (page < page_count);
+			if (valid)
+				offset += 2 + page_length(size, page);
+		}
+		if (!valid || position + offset + 4 > journal_size
+		    || get_u32(record + offset) != checksum(record, offset))
+			break;
+
+		offset = 4;
+		for (uint32_t i = 0; i < count; i++) {
+			unsigned page = get_u16(record + offset);
+			size_t length = page_length(size, page);
+			memcpy(data + (size_t)page * PAGE_SIZE, record + offset + 2, length);
+			offset += 2 + length;
+		}
+		position += offset + 4;
+		records++;
+	}
+
+	if (position < journal_size)
+		printf("The journal '%s' ends with %zu unreadable bytes\n", filename, journal_size - position);
+	printf("Applied %u records from the journal '%s'\n", records, filename);
+	SDL_free(journal);
+	free(filename);
+	return records;
+}
+
+// Writes the shadow copy to the .sav through a temporary file, then starts an
+// empty journal. Crashing in between is harmless since the journal only
+// holds pages the new .sav already has.
+static bool save_journal_compact(struct SaveJournal *journal) {
+	size_t length = strlen(journal->sav_filename);
+	char *temporary = malloc(length + strlen(".tmp") + 1);
+	if (temporary == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the save file name\n");
+		return false;
+	}
+	memcpy(temporary, journal->sav_filename, length);
+	strcpy(temporary + length, ".tmp");
+
+	if (!SDL_SaveFile(temporary, journal->shadow, journal->size)
+	    || !SDL_RenamePath(temporary, journal->sav_filename)) {
+		fprintf(stderr, "[ERROR] Unable to save file '%s': %s\n", journal->sav_filename, SDL_GetError());
+		SDL_RemovePath(temporary);
+		free(temporary);
+		return false;
+	}
+	free(temporary);
+
+	if (journal->file)
+		SDL_CloseIO(journal->file);
+	journal->file = SDL_IOFromFile(journal->journal_filename, "wb");
+	if (!journal->file) {
+		fprintf(stderr, "[ERROR] Unable to create file '%s': %s\n", journal->journal_filename, SDL_GetError());
+		return false;
+	}
+
+	uint8_t header[JOURNAL_HEADER_SIZE];
+	memcpy(header, JOURNAL_MAGIC, 4);
+	put_u32(header + 4, journal->size);
+	SDL_WriteIO(journal->file, header, sizeof(header));
+	SDL_FlushIO(journal->file);
+	journal->journal_size = sizeof(header);
+	return true;
+}
+
+// Moves the pending pages into the shadow copy and a new record. Must be
+// called with the lock held. Returns the size of the record.
+static size_t save_journal_take_pending(struct SaveJournal *journal) {
+	if (journal->pending_count == 0)
+		return 0;
+
+	size_t offset = 4;
+	for (unsigned page = 0; page < journal->page_count; page++) {
+		if (!journal->pending_dirty[page])
+			continue;
+		size_t start  = (size_t)page * PAGE_SIZE;
+		size_t length = page_length(journal->size, page);
+		memcpy(journal->shadow + start, journal->pending + start, length);
+		put_u16(journal->record + offset, page);
+		memcpy(journal->record + offset + 2, journal->pending + start, length);
+		offset += 2 + length;
+		journal->pending_dirty[page] = false;
+	}
+	put_u32(journal->record, journal->pending_count);
+	put_u32(journal->record + offset, checksum(journal->record, offset));
+	journal->pending_count = 0;
+	return offset + 4;
+}
+
+static void save_journal_write(struct SaveJournal *journal, size_t record_size, bool compact) {
+	if (record_size > 0 && journal->file) {
+		if (SDL_WriteIO(journal->file, journal->record, record_size) != record_size)
+			fprintf(stderr, "[ERROR] Unable to write to '%s': %s\n", journal->journal_filename, SDL_GetError());
+		SDL_FlushIO(journal->file);
+		journal->journal_size += record_size;
+	}
+	if (compact || journal->journal_size > COMPACT_RATIO * journal->size)
+		save_journal_compact(journal);
+}
+
+static int save_journal_writer_thread(void *data) {
+	struct SaveJournal *journal = data;
+
+	SDL_LockMutex(journal->lock);
+	while (true) {
+		while (journal->pending_count == 0 && !journal->compact_requested && !journal->stopping)
+			SDL_WaitCondition(journal->work_ready, journal->lock);
+		if (journal->pending_count == 0 && !journal->compact_requested)
+			break;
+
+		size_t record_size = save_journal_take_pending(journal);
+		bool compact = journal->compact_requested;
+		journal->compact_requested = false;
+		journal->working = true;
+		SDL_UnlockMutex(journal->lock);
+
+		save_journal_write(journal, record_size, compact);
+
+		SDL_LockMutex(journal->lock);
+		journal->working = false;
+		SDL_BroadcastCondition(journal->work_done);
+	}
+	SDL_UnlockMutex(journal->lock);
+	return 0;
+}
+
+static void save_journal_free(struct SaveJournal *journal) {
+	if (journal->file)
+		SDL_CloseIO(journal->file);
+	if (journal->work_ready)
+		SDL_DestroyCondition(journal->work_ready);
+	if (journal->work_done)
+		SDL_DestroyCondition(journal->work_done);
+	if (journal->lock)
+		SDL_DestroyMutex(journal->lock);
+	free(journal->sav_filename);
+	free(journal->journal_filename);
+	free(journal->shadow);
+	free(journal->record);
+	free(journal->pending);
+	free(journal->pending_dirty);
+	free(journal->dirty_pages);
+	free(journal);
+}
+
+struct SaveJournal *save_journal_start(const char *sav_filename) {
+	size_t size;
+	const uint8_t *sram = hagemu_get_sram(&size);
+	if (sram == NULL || size == 0)
+		return NULL;
+
+	struct SaveJournal *journal = calloc(1, sizeof(struct SaveJournal));
+	if (journal == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the save journal\n");
+		return NULL;
+	}
+	journal->size = size;
+	journal->page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	journal->sav_filename = malloc(strlen(sav_filename) + 1);
+	journal->journal_filename = journal_name(sav_filename);
+	journal->shadow  = malloc(size);
+	journal->pending = malloc(size);
+	journal->record  = malloc(8 + journal->page_count * 2 + size);
+	journal->pending_dirty = calloc(journal->page_count, sizeof(bool));
+	journal->dirty_pages   = malloc(journal->page_count * sizeof(uint16_t));
+	if (!journal->sav_filename || !journal->journal_filename || !journal->shadow
+	    || !journal->pending || !journal->record || !journal->pending_dirty || !journal->dirty_pages) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the save journal\n");
+		save_journal_free(journal);
+		return NULL;
+	}
+	strcpy(journal->sav_filename, sav_filename);
+
+	// Everything the core has now is written here, so nothing is dirty
+	memcpy(journal->shadow, sram, size);
+	while (hagemu_take_sram_dirty_pages(journal->dirty_pages, journal->page_count) > 0)
+		continue;
+	if (!save_journal_compact(journal)) {
+		save_journal_free(journal);
+		return NULL;
+	}
+
+	journal->lock = SDL_CreateMutex();
+	journal->work_ready = SDL_CreateCondition();
+	journal->work_done  = SDL_CreateCondition();
+#ifndef __EMSCRIPTEN__
+	if (journal->lock && journal->work_ready && journal->work_done)
+		journal->writer = SDL_CreateThread(save_journal_writer_thread, "save journal", journal);
+	if (!journal->writer)
+		printf("Unable to start the save journal thread. Saving on the main thread instead...\n");
+#endif
+
+	printf("Saving SRAM changes to '%s'\n", journal->journal_filename);
+	return journal;
+}
+
+bool save_journal_flush(struct SaveJournal *journal) {
+	unsigned count = hagemu_take_sram_dirty_pages(journal->dirty_pages, journal->page_count);
+	if (count == 0)
+		return false;
+
+	size_t size;
+	const uint8_t *sram = hagemu_get_sram(&size);
+	SDL_LockMutex(journal->lock);
+	for (unsigned i = 0; i < count; i++) {
+		unsigned page = journal->dirty_pages[i];
+		if (page >= journal->page_count)
+			continue;
+		size_t start = (size_t)page * PAGE_SIZE;
+		memcpy(journal->pending + start, sram + start, page_length(journal->size, page));
+		if (!journal->pending_dirty[page]) {
+			journal->pending_dirty[page] = true;
+			journal->pending_count++;
+		}
+	}
+	SDL_SignalCondition(journal->work_ready);
+	SDL_UnlockMutex(journal->lock);
+
+	if (!journal->writer)
+		save_journal_write(journal, save_journal_take_pending(journal), false);
+	return true;
+}
+
+void save_journal_save(struct SaveJournal *journal) {
+	save_journal_flush(journal);
+	if (!journal->writer) {
+		save_journal_write(journal, 0, true);
+		printf("Saved SRAM data to '%s'\n", journal->sav_filename);
+		return;
+	}
+
+	SDL_LockMutex(journal->lock);
+	journal->compact_requested = true;
+	SDL_SignalCondition(journal->work_ready);
+	while (journal->pending_count > 0 || journal->compact_requested || journal->working)
+		SDL_WaitCondition(journal->work_done, journal->lock);
+	SDL_UnlockMutex(journal->lock);
+	printf("Saved SRAM data to '%s'\n", journal->sav_filename);
+}
+
+void save_journal_stop(struct SaveJournal *journal) {
+	save_journal_save(journal);
+	if (journal->writer) {
+		SDL_LockMutex(journal->lock);
+		journal->stopping = true;
+		SDL_SignalCondition(journal->work_ready);
+		SDL_UnlockMutex(journal->lock);
+		SDL_WaitThread(journal->writer, NULL);
+	}
+	save_journal_free(journal);
+}
@@ -0,0 +1,33 @@
+#ifndef SAVE_JOURNAL_H
+#define SAVE_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Battery saves are kept as <name>.sav plus <name>.sav.journal. The journal
+// only holds the SRAM pages that changed since the .sav was last written, so
+// saving every second costs a few hundred bytes instead of the whole file.
+// Once the journal grows past a few times the SRAM size, it's folded back
+// into the .sav. A separate thread does the writing where threads exist.
+struct SaveJournal;
+
+// Applies whatever a previous session left in the journal of sav_filename
+// to data, which holds the contents of the .sav. Returns the records applied.
+unsigned save_journal_replay(const char *sav_filename, uint8_t *data, size_t size);
+// Whether the journal of sav_filename holds anything that isn't in it yet
+bool save_journal_pending(const char *sav_filename);
+
+// Writes the current SRAM to sav_filename, empties the journal and starts
+// the writer thread
+struct SaveJournal *save_journal_start(const char *sav_filename);
+// Copies the pages that changed out of the core and lets the writer append
+// them to the journal. Cheap enough to call every frame. Returns whether
+// anything changed.
+bool save_journal_flush(struct SaveJournal *journal);
+// Flushes, folds the journal into the .sav and waits until both are written
+void save_journal_save(struct SaveJournal *journal);
+// Saves, then stops the writer and closes the files
+void save_journal_stop(struct SaveJournal *journal);
+
+#endif // SAVE_JOURNAL_H
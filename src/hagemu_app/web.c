@@ -1,5 +1,6 @@
 #include "web.h"
 #include <stdio.h>
+#include "save_journal.h"
 
 #ifdef __EMSCRIPTEN__
 
@@ -21,12 +22,44 @@ const uint8_t* web_get_sram_pointer(void) {
 	return NULL;
 }
 
+// The page calls this before it unloads. With the journal running, only the
+// changes are written out, the .sav gets folded in on a later visit.
 EMSCRIPTEN_KEEPALIVE
 void web_save_sram_file(void) {
-	if (hagemu_app && hagemu_app->rom_filename)
+	if (!hagemu_app || !hagemu_app->rom_filename)
+		return;
+	if (hagemu_app->save_journal && !hagemu_app->playing_movie)
+		save_journal_flush(hagemu_app->save_journal);
+	else
 		hagemu_save_sram_file(hagemu_app);
 }
 
+// Writes the files in /savedata to IndexedDB in the background. A sync that's
+// asked for while another is running starts once that one is done.
+EMSCRIPTEN_KEEPALIVE
+void web_sync_files(void) {
+	EM_ASM({
+		if (Module.hagemuSyncing) {
+			Module.hagemuSyncAgain = true;
+			return;
+		}
+		Module.hagemuSyncing = true;
+		var sync = function () {
+			FS.syncfs(false, function (err) {
+				if (err)
+					console.log("Error writing to the offline database");
+				if (Module.hagemuSyncAgain) {
+					Module.hagemuSyncAgain = false;
+					sync();
+				} else {
+					Module.hagemuSyncing = false;
+				}
+			});
+		};
+		sync();
+	});
+}
+
 EMSCRIPTEN_KEEPALIVE
 size_t web_get_sram_size(void) {
 	if (hagemu_app && hagemu_app->rom_filename && hagemu_sram_available()) {
@@ -9,6 +9,7 @@
 void web_save_pointer_for_javascript(struct HagemuApp *app);
 const uint8_t* web_get_sram_pointer(void);
 void web_save_sram_file(void);
+void web_sync_files(void);
 size_t web_get_sram_size(void);
 const char *web_get_sram_file_name(void);
 void web_load_file(const char *filename);
@@ -1,19 +1,30 @@
 #include "mmu.h"
+#include "hash.h"
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 #define APU_TICK_RATE (1 << 21)
-#define AUDIO_QUEUE_SIZE 8192
+#define APU_BATCH_TICKS 256 // At most this many ticks are put off at once
+#define AUDIO_QUEUE_SIZE 8192 // Default capacity, must be a power of two
 #define INITIAL_TARGET_SAMPLE_RATE 48000
 
 #define APU_REGISTER_START  0xFF10
 #define APU_REGISTER_LENGTH 0x0030
 #define APU_WAVE_DATA_START 0xFF30
 
+// Band-limited steps are 16 output samples wide and placed with 1/32 of a
+// sample precision. The ring must be a power of two larger than the width.
+#define BLEP_WIDTH  16
+#define BLEP_PHASES 32
+#define BLEP_RING   32
+
 int TARGET_SAMPLE_RATE = INITIAL_TARGET_SAMPLE_RATE;
-float DECIMATION_FACTOR = ((float)APU_TICK_RATE / (float)INITIAL_TARGET_SAMPLE_RATE);
-float decimation_counter = 0.0;
+double RATE_RATIO = 1.0; // Fine adjustment of the rate for drift correction
+// Output samples per APU tick as a 32.32 fixed point number
+uint64_t SAMPLES_PER_TICK = ((uint64_t)INITIAL_TARGET_SAMPLE_RATE << 32) / APU_TICK_RATE;
 
 typedef struct {
 	float left;
@@ -28,6 +39,7 @@ typedef struct {
 struct Channel {
 	// All channels
 	unsigned ticks;
+	unsigned idle_ticks; // Not counted on the timer yet because the channel is silent
 	unsigned period_value;
 	bool     enabled;
 	bool     dac_enabled;
@@ -68,23 +80,65 @@ struct Channel {
 	bool     lfsr_last_out;
 };
 
+// Instead of mixing every tick, the output level is only looked at when it
+// changes. Each change adds a band-limited step to the upcoming samples, and
+// samples are finished by summing up the steps as the clock passes them.
+struct BlepBuffer {
+	int32_t deltas[BLEP_RING][2]; // Left and right, scaled by 32768
+	int32_t sum_left;
+	int32_t sum_right;
+	uint64_t clock; // Position in output samples, 32.32 fixed point
+	IntegerAudioFrame level;
+};
+
+// The same synthesis for each channel on its own, before panning and volume.
+// It shares the sample clock of the main output.
+struct StemBuffer {
+	struct HagemuAudioStems config;
+	bool enabled;
+	unsigned written; // Frames written into the caller's buffers so far
+	int32_t deltas[BLEP_RING][4];
+	int32_t sums[4];
+	int levels[4]; // DAC output of each channel in [-15, 15]
+};
+
+// A caller-registered buffer that finished samples go straight into
+struct DirectOutput {
+	struct HagemuAudioOutput config;
+	bool enabled;
+	unsigned written;
+};
+
+// A single producer, single consumer ring. The emulation thread only moves
+// the head and the reader only moves the tail, so audio can be read from
+// another thread without locks. Both indices count up forever and are
+// masked by the capacity, which is always a power of two.
 struct AudioQueue {
-	AudioFrame frames[AUDIO_QUEUE_SIZE];
-	unsigned start;
-	unsigned end;
-	unsigned size;
+	AudioFrame *frames;
+	unsigned capacity;
+	unsigned head;    // Frames ever written
+	unsigned tail;    // Frames ever read
+	unsigned dropped; // Frames lost because the queue was full
 };
 
+static AudioFrame default_audio_frames[AUDIO_QUEUE_SIZE];
+
 struct HagemuAPU {
 	struct Channel ch1;
 	struct Channel ch2;
 	struct Channel ch3;
 	struct Channel ch4;
 	struct AudioQueue audio_queue;
+	struct BlepBuffer blep;
+	struct StemBuffer stems;
+	struct DirectOutput direct_output;
 	IntegerAudioFrame highpass_capacitor;
-	IntegerAudioFrame lowpass_prev_frame;
 	unsigned ticks;
+	unsigned pending_ticks; // Ticks that haven't been run yet
 	unsigned frame_sequencer_clock_step;
+	uint64_t run_ticks;  // Since the last reset, to tell how many are skipped
+	uint64_t run_steps;  // over at once on average
+	uint64_t audio_hash; // Of every sample output since the last frame
 	uint8_t wave_data[16];
 	uint8_t raw_regs[APU_REGISTER_LENGTH];
 	uint8_t volume_left;
@@ -98,50 +152,198 @@ struct HagemuAPU {
 	bool ch4_output_right;
 	bool ch4_output_left;
 	bool enabled;
-} apu = { 0 };
+} apu = {
+	.audio_queue = { .frames = default_audio_frames, .capacity = AUDIO_QUEUE_SIZE },
+};
+
+static void apu_catch_up(void);
+
+// The band-limited steps are placed straight at the output rate, so changing
+// the rate only changes how fast the sample clock moves. No separate
+// resampling pass is needed and the ratio can be changed at any time.
+static void apu_update_sample_clock(void) {
+	double samples_per_tick = TARGET_SAMPLE_RATE * RATE_RATIO / APU_TICK_RATE;
+	SAMPLES_PER_TICK = (uint64_t)(samples_per_tick * 4294967296.0);
+}
 
 void apu_set_audio_sample_rate(unsigned new_sample_rate) {
+	apu_catch_up();
 	TARGET_SAMPLE_RATE = new_sample_rate;
-	DECIMATION_FACTOR = ((float)APU_TICK_RATE / (float)new_sample_rate);
+	apu_update_sample_clock();
+}
+
+void apu_set_audio_rate_ratio(double ratio) {
+	apu_catch_up();
+	RATE_RATIO = ratio;
+	apu_update_sample_clock();
 }
 
 static void queue_push(struct AudioQueue *queue, AudioFrame frame) {
-	if (queue->size == AUDIO_QUEUE_SIZE) {
-		printf("Audio Frame was dropped because the queue was full.\n");
+	unsigned head = queue->head;
+	unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if (head - tail == queue->capacity) {
+		__atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
 		return;
 	}
-	queue->frames[queue->end] = frame;
-	queue->size++;
-	queue->end++;
-	queue->end %= AUDIO_QUEUE_SIZE;
+	queue->frames[head & (queue->capacity - 1)] = frame;
+	// The frame has to be written before the reader can see it
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
 }
 
 static void queue_drain(struct AudioQueue *queue, float* output, unsigned count) {
 	unsigned bytes_per_frame = sizeof(AudioFrame);
-	if (queue->start + count > AUDIO_QUEUE_SIZE) {
-		unsigned until_end = AUDIO_QUEUE_SIZE - queue->start;
-		memcpy(output, queue->frames + queue->start, until_end * bytes_per_frame);
+	unsigned start = queue->tail & (queue->capacity - 1);
+	if (start + count > queue->capacity) {
+		unsigned until_end = queue->capacity - start;
+		memcpy(output, queue->frames + start, until_end * bytes_per_frame);
 		memcpy(output + 2 * until_end, queue->frames, (count - until_end) * bytes_per_frame);
 	} else {
-		memcpy(output, queue->frames + queue->start, count * bytes_per_frame);
+		memcpy(output, queue->frames + start, count * bytes_per_frame);
 	}
-	queue->size -= count;
-	queue->start += count;
-	queue->start %= AUDIO_QUEUE_SIZE;
+	// The frames have to be copied out before the writer can reuse them
+	__atomic_store_n(&queue->tail, queue->tail + count, __ATOMIC_RELEASE);
 }
 
+static inline int16_t sample_to_int16(float sample) {
+	if (sample > 1.0f)  sample = 1.0f;
+	if (sample < -1.0f) sample = -1.0f;
+	return (int16_t)(sample * 32767.0f);
+}
+
+static void direct_output_write(struct DirectOutput *output, AudioFrame frame) {
+	if (output->written == output->config.capacity) {
+		__atomic_fetch_add(&apu.audio_queue.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	float left  = frame.left  * output->config.gain;
+	float right = frame.right * output->config.gain;
+	unsigned index = 2 * output->written;
+	if (output->config.format == SAMPLE_FORMAT_INT16) {
+		int16_t *samples = output->config.buffer;
+		samples[index]     = sample_to_int16(left);
+		samples[index + 1] = sample_to_int16(right);
+	} else {
+		float *samples = output->config.buffer;
+		samples[index]     = left;
+		samples[index + 1] = right;
+	}
+	output->written++;
+}
+
+static void apu_output_frame(AudioFrame frame) {
+	// Hashed before it can be dropped, so the hash doesn't depend on how
+	// quickly the host reads the audio
+	uint64_t bits;
+	memcpy(&bits, &frame, sizeof(bits));
+	apu.audio_hash = hash_mix(apu.audio_hash, bits);
+
+	if (apu.direct_output.enabled)
+		direct_output_write(&apu.direct_output, frame);
+	else
+		queue_push(&apu.audio_queue, frame);
+}
+
+// Passing NULL goes back to the queue
+bool apu_set_audio_output(const struct HagemuAudioOutput *output) {
+	apu_catch_up();
+	memset(&apu.direct_output, 0, sizeof(apu.direct_output));
+	if (output == NULL)
+		return true;
+
+	if (output->buffer == NULL || output->capacity == 0) {
+		fprintf(stderr, "[ERROR] The audio output needs a buffer with room for at least one frame\n");
+		return false;
+	}
+	if (output->format != SAMPLE_FORMAT_FLOAT32 && output->format != SAMPLE_FORMAT_INT16) {
+		fprintf(stderr, "[ERROR] Unknown audio sample format %d\n", output->format);
+		return false;
+	}
+	apu.direct_output.config  = *output;
+	apu.direct_output.enabled = true;
+	return true;
+}
+
+// Returns the frames written since the last call and rewinds the buffer
+unsigned apu_take_audio_output(void) {
+	apu_catch_up();
+	unsigned written = apu.direct_output.written;
+	apu.direct_output.written = 0;
+	return written;
+}
+
+// Safe to call from the thread that reads the audio
 unsigned apu_audio_available(void) {
-	return apu.audio_queue.size;
+	unsigned head = __atomic_load_n(&apu.audio_queue.head, __ATOMIC_ACQUIRE);
+	return head - apu.audio_queue.tail;
 }
 
 unsigned apu_read_audio(float *output, unsigned max_frames) {
-	if (max_frames > apu_audio_available())
-		max_frames = apu_audio_available();
+	unsigned available = apu_audio_available();
+	if (max_frames > available)
+		max_frames = available;
 	queue_drain(&apu.audio_queue, output, max_frames);
 	return max_frames;
 }
 
+// Always fills the whole output, padding with silence when the emulator
+// hasn't produced enough audio yet. Returns how many frames were real.
+unsigned apu_pull_audio(float *output, unsigned frame_count) {
+	unsigned count = apu_read_audio(output, frame_count);
+	memset(output + 2 * count, 0, (frame_count - count) * sizeof(AudioFrame));
+	return count;
+}
+
+unsigned apu_get_dropped_audio(void) {
+	return __atomic_load_n(&apu.audio_queue.dropped, __ATOMIC_RELAXED);
+}
+
+// Throws away any queued audio. Neither side may be using the queue.
+bool apu_set_audio_capacity(unsigned frame_count) {
+	unsigned capacity = 1;
+	while (capacity < frame_count && capacity < (1u << 24))
+		capacity <<= 1;
+	if (capacity < frame_count) {
+		fprintf(stderr, "[ERROR] An audio queue of %u frames is too large\n", frame_count);
+		return false;
+	}
+
+	AudioFrame *frames = default_audio_frames;
+	if (capacity > AUDIO_QUEUE_SIZE) {
+		frames = malloc(capacity * sizeof(AudioFrame));
+		if (frames == NULL) {
+			fprintf(stderr, "[ERROR] Failed to allocate memory for the audio queue\n");
+			return false;
+		}
+	}
+
+	if (apu.audio_queue.frames != default_audio_frames)
+		free(apu.audio_queue.frames);
+	apu.audio_queue.frames   = frames;
+	apu.audio_queue.capacity = capacity;
+	apu.audio_queue.head     = 0;
+	apu.audio_queue.tail     = 0;
+	return true;
+}
+
+// Called by the PPU once per frame
+uint64_t apu_take_audio_hash(void) {
+	apu_catch_up();
+	uint64_t hash = apu.audio_hash;
+	apu.audio_hash = HASH_SEED;
+	return hash;
+}
+
+double apu_average_skip(void) {
+	apu_catch_up();
+	return apu.run_steps ? (double)apu.run_ticks / apu.run_steps : 0.0;
+}
+
 void apu_reset(void) {
+	apu_catch_up();
+	apu.audio_hash = HASH_SEED;
+	apu.run_ticks = 0;
+	apu.run_steps = 0;
 	memset(&apu.ch1, 0, sizeof(struct Channel));
 	memset(&apu.ch2, 0, sizeof(struct Channel));
 	memset(&apu.ch3, 0, sizeof(struct Channel));
@@ -215,54 +417,186 @@ static void tick_envelope(struct Channel *channel) {
 	}
 }
 
-static void tick_pulse_channel(struct Channel *channel) {
-	channel->ticks++;
-	uint32_t period = 2 * (2048 - channel->period_value);
-	if (channel->ticks >= period ) {
-		channel->ticks -= period;
-		channel->duty_wave_index++;
-		channel->duty_wave_index %= 8;
+// Counts n ticks on a frequency timer and returns how many times it reached
+// its period. This matches ticking it one at a time, including after the
+// period was shortened below the count, where it only wraps once per tick
+// until it has caught up.
+static unsigned frequency_timer_advance(unsigned *ticks, unsigned period, unsigned n) {
+	if (period == 0) {
+		*ticks += n;
+		return n;
+	}
+
+	unsigned steps = 0;
+	if (*ticks >= period) {
+		unsigned catch_up = (period > 1) ? *ticks / (period - 1) : n;
+		if (catch_up >= n) {
+			*ticks = *ticks + n - n * period;
+			return n;
+		}
+		*ticks = *ticks + catch_up - catch_up * period;
+		steps = catch_up;
+		n -= catch_up;
+	}
+
+	*ticks += n;
+	steps  += *ticks / period;
+	*ticks %= period;
+	return steps;
+}
+
+// Ticks until the frequency timer next reaches its period
+static inline unsigned frequency_timer_remaining(unsigned ticks, unsigned period) {
+	return (ticks + 1 >= period) ? 1 : period - ticks;
+}
+
+static inline unsigned pulse_period(const struct Channel *channel) {
+	return 2 * (2048 - channel->period_value);
+}
+
+static inline unsigned wave_period(const struct Channel *channel) {
+	return 2048 - channel->period_value;
+}
+
+static void advance_pulse_channel(struct Channel *channel, unsigned n) {
+	unsigned steps = frequency_timer_advance(&channel->ticks, pulse_period(channel), n);
+	channel->duty_wave_index = (channel->duty_wave_index + steps) % 8;
+}
+
+static void advance_wave_channel(struct Channel *channel, unsigned n) {
+	unsigned steps = frequency_timer_advance(&channel->ticks, wave_period(channel), n);
+	channel->wave_index = (channel->wave_index + steps) % 32;
+}
+
+// The LFSR sequences, and where each state is in them. The all ones state
+// is the only one that's not part of its sequence, since it never changes.
+#define LFSR15_LENGTH 32767
+#define LFSR7_LENGTH  127
+static uint16_t lfsr15_sequence[LFSR15_LENGTH];
+static uint16_t lfsr15_position[1 << 15];
+static uint8_t  lfsr7_sequence[LFSR7_LENGTH];
+static uint8_t  lfsr7_position[1 << 7];
+static bool     lfsr_tables_ready = false;
+
+static inline unsigned lfsr_step(unsigned lfsr, bool short_mode) {
+	bool bit0 = (lfsr >> 0) & 0x01;
+	bool bit1 = (lfsr >> 1) & 0x01;
+	bool next_bit = !(bit0 ^ bit1);
+
+	lfsr &= ~(1 << 15);
+	lfsr |= (next_bit << 15);
+	if (short_mode) {
+		lfsr &= ~(1 << 7);
+		lfsr |= (next_bit << 7);
 	}
+	return lfsr >> 1;
 }
 
-static void tick_wave_channel(struct Channel *channel) {
-	channel->ticks++;
-	uint32_t period = 2048 - channel->period_value;
-	if (channel->ticks >= period) {
-		channel->ticks -= period;
-		channel->wave_index++;
-		channel->wave_index %= 32;
+static void lfsr_tables_init(void) {
+	unsigned lfsr = 0;
+	for (unsigned i = 0; i < LFSR15_LENGTH; i++) {
+		lfsr15_sequence[i] = lfsr;
+		lfsr15_position[lfsr] = i;
+		lfsr = lfsr_step(lfsr, false);
+	}
+	lfsr = 0;
+	for (unsigned i = 0; i < LFSR7_LENGTH; i++) {
+		lfsr7_sequence[i] = lfsr;
+		lfsr7_position[lfsr] = i;
+		lfsr = lfsr_step(lfsr, true) & 0x7F;
 	}
+	lfsr_tables_ready = true;
 }
 
-static void tick_noise_channel(struct Channel *channel) {
-	channel->ticks++;
-	uint32_t period = channel->period_value;
-	if (channel->ticks >= period) {
-		channel->ticks -= period;
-		bool bit0 = (channel->lfsr >> 0) & 0x01;
-		bool bit1 = (channel->lfsr >> 1) & 0x01;
-		bool next_bit = !(bit0 ^ bit1);
+static void lfsr_advance(struct Channel *channel, unsigned steps) {
+	// Short runs are cheaper to step through
+	if (steps > 16 && !lfsr_tables_ready)
+		lfsr_tables_init();
 
-		channel->lfsr &= ~(1 << 15);
-		channel->lfsr |= (next_bit << 15);
-		if (channel->lfsr_short_mode) {
-			channel->lfsr &= ~(1 << 7);
-			channel->lfsr |= (next_bit << 7);
+	if (steps > 16 && !channel->lfsr_short_mode) {
+		unsigned lfsr = channel->lfsr;
+		if (lfsr == 0x7FFF) {
+			channel->lfsr_last_out = true;
+			return;
 		}
+		unsigned position = lfsr15_position[lfsr];
+		channel->lfsr = lfsr15_sequence[(position + steps) % LFSR15_LENGTH];
+		channel->lfsr_last_out = lfsr15_sequence[(position + steps - 1) % LFSR15_LENGTH] & 0x01;
+		return;
+	}
+
+	// The low 7 bits don't depend on the rest in short mode, and the 8
+	// steps at the end shift new bits into all of the others
+	if (steps > 16) {
+		unsigned low_bits = channel->lfsr & 0x7F;
+		if (low_bits != 0x7F)
+			low_bits = lfsr7_sequence[(lfsr7_position[low_bits] + steps - 8) % LFSR7_LENGTH];
+		channel->lfsr = low_bits;
+		steps = 8;
+	}
+
+	for (unsigned i = 0; i < steps; i++) {
 		channel->lfsr_last_out = channel->lfsr & 0x01;
-		channel->lfsr >>= 1;
+		channel->lfsr = lfsr_step(channel->lfsr, channel->lfsr_short_mode);
 	}
 }
 
-static void apu_tick_channels(void) {
-	tick_pulse_channel(&apu.ch1);
-	tick_pulse_channel(&apu.ch2);
-	tick_wave_channel(&apu.ch3);
-	tick_noise_channel(&apu.ch4);
+static void advance_noise_channel(struct Channel *channel, unsigned n) {
+	unsigned steps = frequency_timer_advance(&channel->ticks, channel->period_value, n);
+	lfsr_advance(channel, steps);
+}
+
+// A channel that's off or has its DAC off outputs nothing, so nothing can
+// tell where its timer is until it's turned on or its period changes
+static inline bool channel_silent(const struct Channel *channel) {
+	return !channel->enabled || !channel->dac_enabled;
+}
+
+static void apu_advance_channels(unsigned n) {
+	if (channel_silent(&apu.ch1)) apu.ch1.idle_ticks += n; else advance_pulse_channel(&apu.ch1, n);
+	if (channel_silent(&apu.ch2)) apu.ch2.idle_ticks += n; else advance_pulse_channel(&apu.ch2, n);
+	if (channel_silent(&apu.ch3)) apu.ch3.idle_ticks += n; else advance_wave_channel(&apu.ch3, n);
+	if (channel_silent(&apu.ch4)) apu.ch4.idle_ticks += n; else advance_noise_channel(&apu.ch4, n);
+}
+
+// Runs the ticks the silent channels put off. Advancing in one go matches
+// advancing bit by bit as long as the period stays the same, so this has to
+// happen before a period changes or a channel turns on.
+static void apu_sync_idle_channels(void) {
+	advance_pulse_channel(&apu.ch1, apu.ch1.idle_ticks);
+	advance_pulse_channel(&apu.ch2, apu.ch2.idle_ticks);
+	advance_wave_channel(&apu.ch3, apu.ch3.idle_ticks);
+	advance_noise_channel(&apu.ch4, apu.ch4.idle_ticks);
+	apu.ch1.idle_ticks = apu.ch2.idle_ticks = apu.ch3.idle_ticks = apu.ch4.idle_ticks = 0;
+}
+
+// Ticks until a channel that's playing could change its output
+static unsigned apu_channels_remaining(void) {
+	unsigned remaining = UINT_MAX;
+	if (!channel_silent(&apu.ch1)) {
+		unsigned ch1 = frequency_timer_remaining(apu.ch1.ticks, pulse_period(&apu.ch1));
+		if (ch1 < remaining) remaining = ch1;
+	}
+	if (!channel_silent(&apu.ch2)) {
+		unsigned ch2 = frequency_timer_remaining(apu.ch2.ticks, pulse_period(&apu.ch2));
+		if (ch2 < remaining) remaining = ch2;
+	}
+	if (!channel_silent(&apu.ch3)) {
+		unsigned ch3 = frequency_timer_remaining(apu.ch3.ticks, wave_period(&apu.ch3));
+		if (ch3 < remaining) remaining = ch3;
+	}
+	if (!channel_silent(&apu.ch4)) {
+		unsigned ch4 = frequency_timer_remaining(apu.ch4.ticks, apu.ch4.period_value);
+		if (ch4 < remaining) remaining = ch4;
+	}
+	return remaining;
 }
 
 static void apu_tick_frame_sequencer(void) {
+	// The sweep can change the period of channel 1 even while it's off.
+	// Syncing every step also keeps the idle ticks from overflowing.
+	apu_sync_idle_channels();
+
 	apu.frame_sequencer_clock_step++;
 	apu.frame_sequencer_clock_step %= 8;
 
@@ -290,23 +624,6 @@ static void apu_tick_frame_sequencer(void) {
 	}
 }
 
-// Alpha should be 1 - exp(-2 * pi * cutoff_freqency / sample_rate)
-/* const float alpha = 0.730f; // 48kHz sample rate, 10kHz cutoff */
-/* const float alpha = 0.649f; // 48kHz sample rate, 8kHz cutoff */
-static IntegerAudioFrame lowpass_filter(IntegerAudioFrame frame) {
-	IntegerAudioFrame frame_diff;
-	frame_diff.left  = frame.left  - apu.lowpass_prev_frame.left;
-	frame_diff.right = frame.right - apu.lowpass_prev_frame.right;
-
-	// This effectively multiplies by 0.6485
-	frame_diff.left  = (frame_diff.left  * 664) / 1024;
-	frame_diff.right = (frame_diff.right * 664) / 1024;
-
-	apu.lowpass_prev_frame.left  += frame_diff.left;
-	apu.lowpass_prev_frame.right += frame_diff.right;
-	return apu.lowpass_prev_frame;
-}
-
 // Emulates the DC Blocking of the gameboy
 static IntegerAudioFrame highpass_filter(IntegerAudioFrame input) {
 	IntegerAudioFrame output = { 0 };
@@ -367,16 +684,19 @@ static uint8_t channel_output_noise(struct Channel *channel) {
 }
 
 
-static IntegerAudioFrame apu_generate_frame(void) {
+// Also stores the output of each channel in outputs
+static IntegerAudioFrame apu_generate_frame(int outputs[4]) {
 	IntegerAudioFrame frame = { 0 };
-	if (!apu.enabled)
+	if (!apu.enabled) {
+		outputs[0] = outputs[1] = outputs[2] = outputs[3] = 0;
 		return frame;
+	}
 
 	// Each channel outputs an integer in [0, 15]
-	int ch1 = channel_output_pulse(&apu.ch1);
-	int ch2 = channel_output_pulse(&apu.ch2);
-	int ch3 = channel_output_wave(&apu.ch3);
-	int ch4 = channel_output_noise(&apu.ch4);
+	int ch1 = outputs[0] = channel_output_pulse(&apu.ch1);
+	int ch2 = outputs[1] = channel_output_pulse(&apu.ch2);
+	int ch3 = outputs[2] = channel_output_wave(&apu.ch3);
+	int ch4 = outputs[3] = channel_output_noise(&apu.ch4);
 
 	frame.left = apu.ch1_output_left * ch1
 		+ apu.ch2_output_left * ch2
@@ -395,52 +715,208 @@ static IntegerAudioFrame apu_generate_frame(void) {
 	return frame;
 }
 
-// The APU ticks twice per M-cycle (approximation 2MHz)
-static void apu_tick_once(void) {
-	if (apu.enabled) {
-		apu.ticks++;
-		apu_tick_channels();
+// Band-limited steps, each summing up to 32768. Row p is for a step
+// that's p/32 of the way between two output samples.
+static const int16_t blep_kernel[BLEP_PHASES][BLEP_WIDTH] = {
+	{ 6, -34, 69, -35, -249, 1115, -3387, 18899, 18899, -3387, 1115, -249, -35, 69, -34, 6 },
+	{ 5, -30, 55, 1, -320, 1230, -3537, 18059, 19711, -3199, 985, -171, -73, 84, -39, 7 },
+	{ 5, -27, 41, 36, -387, 1331, -3647, 17192, 20491, -2970, 840, -87, -114, 99, -42, 7 },
+	{ 4, -22, 27, 69, -447, 1415, -3720, 16304, 21234, -2698, 680, 1, -155, 115, -47, 8 },
+	{ 4, -19, 15, 98, -500, 1484, -3758, 15400, 21937, -2385, 508, 93, -197, 130, -50, 8 },
+	{ 3, -15, 3, 126, -547, 1538, -3762, 14482, 22596, -2028, 323, 189, -240, 145, -54, 9 },
+	{ 3, -13, -8, 152, -588, 1578, -3734, 13554, 23210, -1628, 126, 288, -283, 160, -58, 9 },
+	{ 3, -10, -18, 173, -620, 1602, -3677, 12621, 23775, -1186, -81, 389, -326, 175, -61, 9 },
+	{ 2, -6, -28, 193, -647, 1612, -3591, 11686, 24288, -701, -298, 493, -369, 188, -64, 10 },
+	{ 2, -4, -37, 211, -668, 1610, -3481, 10755, 24745, -172, -524, 597, -410, 201, -67, 10 },
+	{ 1, -1, -44, 225, -682, 1594, -3347, 9829, 25148, 396, -755, 700, -450, 213, -69, 10 },
+	{ 1, 1, -51, 236, -688, 1565, -3191, 8913, 25490, 1006, -991, 803, -490, 225, -71, 10 },
+	{ 1, 2, -56, 245, -690, 1525, -3017, 8011, 25774, 1654, -1231, 904, -526, 234, -72, 10 },
+	{ 1, 4, -61, 251, -686, 1475, -2827, 7126, 25995, 2340, -1471, 1002, -560, 242, -73, 10 },
+	{ 1, 5, -65, 255, -676, 1415, -2623, 6261, 26155, 3061, -1711, 1096, -592, 249, -72, 9 },
+	{ 0, 7, -68, 257, -662, 1346, -2406, 5418, 26251, 3816, -1948, 1185, -618, 253, -72, 9 },
+	{ 0, 8, -70, 256, -642, 1269, -2181, 4603, 26282, 4603, -2181, 1269, -642, 256, -70, 8 },
+	{ 0, 9, -72, 253, -618, 1185, -1948, 3816, 26251, 5418, -2406, 1346, -662, 257, -68, 7 },
+	{ 0, 9, -72, 249, -592, 1096, -1711, 3061, 26155, 6261, -2623, 1415, -676, 255, -65, 6 },
+	{ 0, 10, -73, 242, -560, 1002, -1471, 2340, 25995, 7126, -2827, 1475, -686, 251, -61, 5 },
+	{ 0, 10, -72, 234, -526, 904, -1231, 1654, 25774, 8011, -3017, 1525, -690, 245, -56, 3 },
+	{ 0, 10, -71, 225, -490, 803, -991, 1006, 25490, 8913, -3191, 1565, -688, 236, -51, 2 },
+	{ 0, 10, -69, 213, -450, 700, -755, 396, 25148, 9829, -3347, 1594, -682, 225, -44, 0 },
+	{ 0, 10, -67, 201, -410, 597, -524, -172, 24745, 10755, -3481, 1610, -668, 211, -37, -2 },
+	{ 0, 10, -64, 188, -369, 493, -298, -701, 24288, 11686, -3591, 1612, -647, 193, -28, -4 },
+	{ 0, 9, -61, 175, -326, 389, -81, -1186, 23775, 12621, -3677, 1602, -620, 173, -18, -7 },
+	{ 0, 9, -58, 160, -283, 288, 126, -1628, 23210, 13554, -3734, 1578, -588, 152, -8, -10 },
+	{ 0, 9, -54, 145, -240, 189, 323, -2028, 22596, 14482, -3762, 1538, -547, 126, 3, -12 },
+	{ 0, 8, -50, 130, -197, 93, 508, -2385, 21937, 15400, -3758, 1484, -500, 98, 15, -15 },
+	{ 0, 8, -47, 115, -155, 1, 680, -2698, 21234, 16304, -3720, 1415, -447, 69, 27, -18 },
+	{ 0, 7, -42, 99, -114, -87, 840, -2970, 20491, 17192, -3647, 1331, -387, 36, 41, -22 },
+	{ 0, 7, -39, 84, -73, -171, 985, -3199, 19711, 18059, -3537, 1230, -320, 1, 55, -25 },
+};
 
-		// The frame frequencer ticks at 512 Hz
-		if (apu.ticks == (APU_TICK_RATE / 512)) {
-			apu.ticks = 0;
-			apu_tick_frame_sequencer();
-		}
+static inline void blep_add_step(int delta_left, int delta_right) {
+	unsigned sample = apu.blep.clock >> 32;
+	unsigned phase  = (apu.blep.clock >> (32 - 5)) & (BLEP_PHASES - 1);
+	const int16_t *kernel = blep_kernel[phase];
+	for (int i = 0; i < BLEP_WIDTH; i++) {
+		int32_t *deltas = apu.blep.deltas[(sample + i) & (BLEP_RING - 1)];
+		deltas[0] += delta_left  * kernel[i];
+		deltas[1] += delta_right * kernel[i];
+	}
+}
+
+// A DAC that's turned off outputs 0. Otherwise it maps [0, 15] to [-15, 15].
+static void stems_add_steps(const int outputs[4]) {
+	const struct Channel *channels[4] = { &apu.ch1, &apu.ch2, &apu.ch3, &apu.ch4 };
+	unsigned sample = apu.blep.clock >> 32;
+	unsigned phase  = (apu.blep.clock >> (32 - 5)) & (BLEP_PHASES - 1);
+	const int16_t *kernel = blep_kernel[phase];
+
+	for (int c = 0; c < 4; c++) {
+		bool dac_on = apu.enabled && channels[c]->dac_enabled;
+		int level = dac_on ? 2 * outputs[c] - 15 : 0;
+		int delta = level - apu.stems.levels[c];
+		if (delta == 0)
+			continue;
+		apu.stems.levels[c] = level;
+		for (int i = 0; i < BLEP_WIDTH; i++)
+			apu.stems.deltas[(sample + i) & (BLEP_RING - 1)][c] += delta * kernel[i];
 	}
+}
 
-	IntegerAudioFrame current_frame = apu_generate_frame();
-	static IntegerAudioFrame accumulate = { 0 };
-	decimation_counter += 1.0;
+static void stems_finish_sample(unsigned sample, AudioFrame mix) {
+	int32_t *deltas = apu.stems.deltas[sample & (BLEP_RING - 1)];
+	bool has_room = apu.stems.written < apu.stems.config.capacity;
+	unsigned index = apu.stems.written;
 
-	if (decimation_counter < DECIMATION_FACTOR) {
-		accumulate.left  += current_frame.left;
-		accumulate.right += current_frame.right;
-		return;
+	for (int c = 0; c < 4; c++) {
+		apu.stems.sums[c] += deltas[c];
+		deltas[c] = 0;
+		if (has_room && apu.stems.config.channels[c])
+			apu.stems.config.channels[c][index] = apu.stems.sums[c] / (15.0f * 32768.0f);
 	}
 
-	float leftover = decimation_counter - DECIMATION_FACTOR;
-	float step = 1.0 - leftover;
-	accumulate.left  += current_frame.left  * step;
-	accumulate.right += current_frame.right * step;
-	accumulate.left  *= (apu.volume_left  + 1);
-	accumulate.right *= (apu.volume_right + 1);
-	accumulate = lowpass_filter(accumulate);
-	accumulate = highpass_filter(accumulate);
+	if (has_room && apu.stems.config.mix) {
+		apu.stems.config.mix[2 * index]     = mix.left;
+		apu.stems.config.mix[2 * index + 1] = mix.right;
+	}
+	if (has_room)
+		apu.stems.written++;
+}
+
+// Passing NULL stops writing the stems
+void apu_set_audio_stems(const struct HagemuAudioStems *stems) {
+	apu_catch_up();
+	memset(&apu.stems, 0, sizeof(apu.stems));
+	if (stems == NULL)
+		return;
+	apu.stems.config  = *stems;
+	apu.stems.enabled = true;
+}
+
+// Returns the number of frames written since the last call, and starts
+// writing at the start of the buffers again
+unsigned apu_take_audio_stems(void) {
+	apu_catch_up();
+	unsigned written = apu.stems.written;
+	apu.stems.written = 0;
+	return written;
+}
+
+// No step can reach the sample anymore once the clock has passed it
+static void blep_finish_sample(unsigned sample) {
+	int32_t *deltas = apu.blep.deltas[sample & (BLEP_RING - 1)];
+	apu.blep.sum_left  += deltas[0];
+	apu.blep.sum_right += deltas[1];
+	deltas[0] = deltas[1] = 0;
+
+	// Keep 8 fractional bits for the highpass filter
+	IntegerAudioFrame frame;
+	frame.left  = apu.blep.sum_left  >> 7;
+	frame.right = apu.blep.sum_right >> 7;
+	frame = highpass_filter(frame);
 
 	// Normalize to [-1.0, 1.0]
 	AudioFrame output;
-	output.left  = accumulate.left  / (240.0 * DECIMATION_FACTOR);
-	output.right = accumulate.right / (240.0 * DECIMATION_FACTOR);
-	queue_push(&apu.audio_queue, output);
+	output.left  = frame.left  / (240.0 * 256.0);
+	output.right = frame.right / (240.0 * 256.0);
+	apu_output_frame(output);
+
+	if (apu.stems.enabled)
+		stems_finish_sample(sample, output);
+}
+
+// Ticks until the sample clock passes the start of the next sample
+static inline unsigned blep_remaining(void) {
+	uint64_t next_sample = ((apu.blep.clock >> 32) + 1) << 32;
+	return (next_sample - apu.blep.clock + SAMPLES_PER_TICK - 1) / SAMPLES_PER_TICK;
+}
+
+// Runs the APU for n ticks. Nothing can change between the ticks where a
+// channel's timer wraps, the frame sequencer steps, or a sample is due, so
+// the ticks in between are skipped over all at once. The registers may have
+// been written since the last run, so its first tick is always run alone.
+static void apu_run(unsigned n) {
+	unsigned skip = 1;
+	while (n > 0) {
+		if (n < skip)
+			skip = n;
+		n -= skip;
+		apu.run_ticks += skip;
+		apu.run_steps++;
+
+		// Only the last tick does anything besides moving the clock
+		apu.blep.clock += (uint64_t)(skip - 1) * SAMPLES_PER_TICK;
+		if (apu.enabled) {
+			apu.ticks += skip;
+			apu_advance_channels(skip);
+
+			// The frame frequencer ticks at 512 Hz
+			if (apu.ticks == (APU_TICK_RATE / 512)) {
+				apu.ticks = 0;
+				apu_tick_frame_sequencer();
+			}
+		}
+
+		int outputs[4];
+		IntegerAudioFrame level = apu_generate_frame(outputs);
+		if (apu.stems.enabled)
+			stems_add_steps(outputs);
+
+		level.left  *= (apu.volume_left  + 1);
+		level.right *= (apu.volume_right + 1);
+		if (level.left != apu.blep.level.left || level.right != apu.blep.level.right) {
+			blep_add_step(level.left - apu.blep.level.left, level.right - apu.blep.level.right);
+			apu.blep.level = level;
+		}
+
+		uint64_t old_clock = apu.blep.clock;
+		apu.blep.clock += SAMPLES_PER_TICK;
+		if ((apu.blep.clock >> 32) != (old_clock >> 32))
+			blep_finish_sample(old_clock >> 32);
+
+		skip = blep_remaining();
+		if (apu.enabled) {
+			unsigned channels = apu_channels_remaining();
+			unsigned frame_sequencer = (APU_TICK_RATE / 512) - apu.ticks;
+			if (channels < skip) skip = channels;
+			if (frame_sequencer < skip) skip = frame_sequencer;
+		}
+	}
+}
 
-	decimation_counter = leftover;
-	accumulate.left  = current_frame.left  * leftover;
-	accumulate.right = current_frame.right * leftover;
+// Runs the ticks that have been put off. This has to happen before anything
+// reads or changes the state of the APU.
+static void apu_catch_up(void) {
+	unsigned n = apu.pending_ticks;
+	apu.pending_ticks = 0;
+	apu_run(n);
 }
 
+// The APU ticks twice per M-cycle (approximation 2MHz). The ticks are only
+// counted here and run in batches.
 void apu_tick(void) {
-	apu_tick_once();
-	apu_tick_once();
+	apu.pending_ticks += 2;
+	if (apu.pending_ticks >= APU_BATCH_TICKS)
+		apu_catch_up();
 }
 
 // Use bit shifting and bitmasks to get the value of the
@@ -542,6 +1018,8 @@ static uint8_t apu_register_write_while_off(uint16_t address, uint8_t value) {
 }
 
 void apu_register_write(uint16_t address, uint8_t value) {
+	apu_catch_up();
+	apu_sync_idle_channels();
 	if (apu.enabled == false)
 		value = apu_register_write_while_off(address, value);
 
@@ -739,6 +1217,7 @@ static uint8_t apu_register_read_nr52(void) {
 }
 
 uint8_t apu_register_read(uint16_t address) {
+	apu_catch_up();
 	uint8_t bit_mask = 0x00;
 	switch (address) {
 
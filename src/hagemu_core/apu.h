@@ -1,6 +1,8 @@
 #ifndef APU_H
 #define APU_H
 #include <stdint.h>
+#include <stdbool.h>
+#include "core_types.h"
 
 void apu_tick(void);
 void apu_reset(void);
@@ -10,6 +12,16 @@ uint8_t apu_register_read(uint16_t address);
 
 unsigned apu_read_audio(float *output, unsigned frame_count);
 unsigned apu_audio_available(void);
+unsigned apu_pull_audio(float *output, unsigned frame_count);
+unsigned apu_get_dropped_audio(void);
+bool apu_set_audio_capacity(unsigned frame_count);
+uint64_t apu_take_audio_hash(void);
+double apu_average_skip(void);
 void apu_set_audio_sample_rate(unsigned new_sample_rate);
+void apu_set_audio_rate_ratio(double ratio);
+void apu_set_audio_stems(const struct HagemuAudioStems *stems);
+unsigned apu_take_audio_stems(void);
+bool apu_set_audio_output(const struct HagemuAudioOutput *output);
+unsigned apu_take_audio_output(void);
 
 #endif
@@ -1,3 +1,10 @@
+// The save file can only be mapped where there's mmap. Emscripten has one,
+// but its files aren't written back to storage.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define _POSIX_C_SOURCE 200809L
+#define CART_SRAM_MMAP
+#endif
+
 #include "cart.h"
 #include <stdio.h>
 #include <string.h>
@@ -7,11 +14,22 @@
 #include "mbc3.h"
 #include "mbc5.h"
 #include "rtc.h"
+#include "rom_image.h"
+
+#ifdef CART_SRAM_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define GAME_TITLE_LOCATION 0x0134
 #define CART_TYPE_LOCATION  0x0147
 #define CART_SIZE_LOCATION  0x0148
 #define RAM_SIZE_LOCATION   0x0149
+#define HEADER_CHECKSUM_LOCATION 0x014D
+#define GLOBAL_CHECKSUM_LOCATION 0x014E
+#define CGB_FLAG_LOCATION   0x0143
 
 struct HagemuCart cart = { .rom_index = 1 };
 
@@ -57,27 +75,212 @@ const size_t ram_size_table[] = {
 	[5] =  64 * 1024,
 };
 
-static void cart_set_info(struct HagemuCart *cart) {
-	uint8_t mbc_info_byte = cart->rom[0][CART_TYPE_LOCATION];
-	uint8_t rom_size_byte = cart->rom[0][CART_SIZE_LOCATION];
-	uint8_t ram_size_byte = cart->rom[0][RAM_SIZE_LOCATION];
+#define CART_TYPE_COUNT (sizeof(cart_info_table) / sizeof(cart_info_table[0]))
+#define RAM_SIZE_COUNT  (sizeof(ram_size_table) / sizeof(ram_size_table[0]))
+
+// Cartridge types missing from the table are all zeroes, same as type 0x00
+static bool cart_type_known(uint8_t type) {
+	if (type >= CART_TYPE_COUNT)
+		return false;
+	return type == 0x00 || cart_info_table[type].type != NO_MBC || cart_info_table[type].has_ram;
+}
 
-	memset(cart->title, 0, sizeof(cart->title));
-	memcpy(cart->title, &cart->rom[0][GAME_TITLE_LOCATION], 16);
-	if ((uint8_t)cart->title[15] == 0x80 ||
-	    (uint8_t)cart->title[15] == 0xC0) {
-		cart->title[15] = '\0';
+static bool cart_type_supported(enum MBCType type) {
+	switch (type) {
+	case NO_MBC: case MBC1: case MBC2: case MBC3: case MBC5:
+		return true;
+	default:
+		return false;
 	}
-	cart->info     = cart_info_table[mbc_info_byte];
-	cart->rom_size = 32 * (1 << rom_size_byte) * 1024;
+}
+
+// Only reads the first HAGEMU_HEADER_SIZE bytes, so it works without
+// loading the whole rom
+bool cart_parse_header(const uint8_t *data, size_t size, struct HagemuRomHeader *header) {
+	memset(header, 0, sizeof(struct HagemuRomHeader));
+	if (size < HAGEMU_HEADER_SIZE)
+		return false;
+
+	memcpy(header->title, &data[GAME_TITLE_LOCATION], 16);
+	if (data[GAME_TITLE_LOCATION + 15] == 0x80 ||
+	    data[GAME_TITLE_LOCATION + 15] == 0xC0) {
+		header->title[15] = '\0';
+	}
+	header->cgb_flag  = data[CGB_FLAG_LOCATION];
+	header->cart_type = data[CART_TYPE_LOCATION];
+
+	uint8_t checksum = 0;
+	for (unsigned i = GAME_TITLE_LOCATION; i < HEADER_CHECKSUM_LOCATION; i++)
+		checksum = checksum - data[i] - 1;
+	header->header_checksum = data[HEADER_CHECKSUM_LOCATION];
+	header->checksum_valid  = (checksum == header->header_checksum);
+	header->global_checksum = (data[GLOBAL_CHECKSUM_LOCATION] << 8) | data[GLOBAL_CHECKSUM_LOCATION + 1];
+
+	uint8_t rom_size_byte = data[CART_SIZE_LOCATION];
+	uint8_t ram_size_byte = data[RAM_SIZE_LOCATION];
+	if (rom_size_byte <= 8)
+		header->rom_size = 32 * (1 << rom_size_byte) * 1024;
+
+	struct HagemuCartInfo info = { .type = NO_MBC };
+	if (cart_type_known(header->cart_type)) {
+		info = cart_info_table[header->cart_type];
+		header->supported = cart_type_supported(info.type);
+	}
+	header->mbc         = info.type;
+	header->has_ram     = info.has_ram;
+	header->has_battery = info.has_battery;
+	header->has_timer   = info.has_timer;
+	header->has_rumble  = info.has_rumble;
+
 	// The MBC2 mapper has a fixed RAM size of 256 bytes
-	if (cart->info.type == MBC2)
-		cart->ram_size = 0x200;
+	if (info.type == MBC2)
+		header->ram_size = 0x200;
+	else if (ram_size_byte < RAM_SIZE_COUNT)
+		header->ram_size = ram_size_table[ram_size_byte];
+
+	if (info.has_timer)
+		header->ram_size += RTC_SERIALIZED_SIZE;
+	return true;
+}
+
+static bool cart_set_info(struct HagemuCart *cart, size_t size) {
+	struct HagemuRomHeader header;
+	if (!cart_parse_header(cart->rom[0], size, &header))
+		return false;
+
+	memcpy(cart->title, header.title, sizeof(cart->title));
+	if (cart_type_known(header.cart_type))
+		cart->info = cart_info_table[header.cart_type];
 	else
-		cart->ram_size = ram_size_table[ram_size_byte];;
+		cart->info = (struct HagemuCartInfo){ .type = NO_MBC };
+	cart->rom_size = header.rom_size;
+	cart->ram_size = header.ram_size;
+	// The mappers need a bank count even when the size byte is unknown, so
+	// go by the image, rounded up to the 2 banks every rom has at least
+	if (cart->rom_size == 0) {
+		size_t banks = (size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE;
+		cart->rom_size = (banks < 2 ? 2 : banks) * ROM_BANK_SIZE;
+	}
+	return true;
+}
+
+static void cart_mark_pages(size_t start, size_t end) {
+	for (size_t page = start / SRAM_PAGE_SIZE; page * SRAM_PAGE_SIZE < end; page++)
+		cart.sram_dirty[page / 64] |= 1ull << (page % 64);
+}
+
+void cart_rtc_changed(struct HagemuCart *cart) {
+	if (!cart->info.has_timer || cart->ram_size < RTC_SERIALIZED_SIZE)
+		return;
+	size_t rtc_start = cart->ram_size - RTC_SERIALIZED_SIZE;
+	cart_mark_pages(rtc_start, cart->ram_size);
+
+	// Nobody asks for the SRAM when it's mapped, so keep the file up to date
+	if (cart->ram_mapped) {
+		size_t rtc_size;
+		const uint8_t *rtc_data = rtc_serialize(&rtc_size);
+		memcpy((uint8_t *)cart->ram + rtc_start, rtc_data, RTC_SERIALIZED_SIZE);
+	}
+}
+
+static void cart_free_ram(void) {
+	if (cart.ram == NULL)
+		return;
+#ifdef CART_SRAM_MMAP
+	if (cart.ram_mapped)
+		munmap(cart.ram, cart.ram_size);
+	else
+		free(cart.ram);
+#else
+	free(cart.ram);
+#endif
+	cart.ram = NULL;
+	cart.ram_mapped = false;
+}
+
+// Makes the save file itself the SRAM. Every write goes straight into the
+// page cache and the OS writes it back whenever it likes, even if the
+// emulator crashes. A missing or empty file is made the right size.
+bool cart_map_sram(const char *filename) {
+#ifdef CART_SRAM_MMAP
+	if (!cart.rom || cart.ram_size == 0 || !cart.info.has_battery) {
+		printf("Unable to map '%s'. This cartridge doesn't support battery-backed RAM.\n", filename);
+		return false;
+	}
+
+	int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		fprintf(stderr, "Error: Unable to open the save file '%s'\n", filename);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	// Older saves might have a shorter RTC trailer or none at all
+	size_t file_size = info.st_size;
+	size_t rtc_start = cart.info.has_timer ? cart.ram_size - RTC_SERIALIZED_SIZE : cart.ram_size;
+	size_t rtc_size  = (file_size > rtc_start) ? file_size - rtc_start : 0;
+	bool blank = (file_size == 0);
+	if (!blank && (file_size < rtc_start || (rtc_size != 0 && rtc_size != 44 && rtc_size != 48)
+	               || (!cart.info.has_timer && file_size != cart.ram_size))) {
+		printf("Unable to map '%s'. Expected %zu bytes, but the file is %zu bytes\n",
+		       filename, cart.ram_size, file_size);
+		close(fd);
+		return false;
+	}
+
+	if (file_size != cart.ram_size && ftruncate(fd, cart.ram_size) != 0) {
+		fprintf(stderr, "Error: Unable to resize the save file '%s'\n", filename);
+		close(fd);
+		return false;
+	}
+	void *ram = mmap(NULL, cart.ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ram == MAP_FAILED) {
+		fprintf(stderr, "Error: Unable to map the save file '%s'\n", filename);
+		return false;
+	}
+
+	cart_free_ram();
+	cart.ram = ram;
+	cart.ram_mapped = true;
+	memset(cart.sram_dirty, 0, sizeof(cart.sram_dirty));
+	if (blank)
+		memset(cart.ram, 0xFF, rtc_start);
 
-	if (cart->info.has_timer)
-		cart->ram_size += RTC_SERIALIZED_SIZE;
+	if (cart.info.has_timer) {
+		if (rtc_size == 0)
+			rtc_reset();
+		else
+			rtc_deserialize((uint8_t *)cart.ram + rtc_start, rtc_size);
+		cart_rtc_changed(&cart);
+	}
+	printf("Mapped the save file '%s' as the cartridge RAM\n", filename);
+	return true;
+#else
+	printf("Unable to map '%s'. Mapping save files isn't supported on this platform.\n", filename);
+	return false;
+#endif
+}
+
+// Pages stay dirty if they don't fit, so the rest come with the next call
+unsigned cart_take_dirty_pages(uint16_t *pages, unsigned max_pages) {
+	unsigned count = 0;
+	for (unsigned i = 0; i < SRAM_DIRTY_WORDS; i++) {
+		while (cart.sram_dirty[i] != 0) {
+			if (count == max_pages)
+				return count;
+			unsigned bit = __builtin_ctzll(cart.sram_dirty[i]);
+			cart.sram_dirty[i] &= cart.sram_dirty[i] - 1;
+			pages[count++] = i * 64 + bit;
+		}
+	}
+	return count;
+}
+
+bool cart_get_header(struct HagemuRomHeader *header) {
+	return cart.rom != NULL && cart_parse_header((const uint8_t *)cart.rom, HAGEMU_HEADER_SIZE, header);
 }
 
 bool cart_sram_available(void) {
@@ -98,6 +301,8 @@ bool cart_set_sram(const uint8_t *data, size_t size) {
 
 	printf("Copying SRAM data to emulator core\n");
 	memcpy(cart.ram, data, size);
+	// Whoever loaded the data already has it
+	memset(cart.sram_dirty, 0, sizeof(cart.sram_dirty));
 
 	if (!cart.info.has_timer)
 		return true;
@@ -144,31 +349,81 @@ const uint8_t *cart_get_sram(size_t *out_size) {
 }
 
 void cart_set_rom(const uint8_t *data, size_t size) {
+	struct HagemuRomImage *image = rom_image_share(data, size);
+	if (!image) {
+		fprintf(stderr, "Error: Failed to allocated the rom data\n");
+		exit(EXIT_FAILURE);
+	}
+	cart_set_rom_image(image);
+	rom_image_release(image);
+}
+
+// The mapper starts over and RAM without a battery loses its contents
+void cart_reset(void) {
 	cart.rom_index = 1;
 	cart.ram_index = 0;
 	cart.ram_enabled = false;
+	cart.mbc_banking_mode = false;
+	if (cart.ram != NULL && !cart.info.has_battery)
+		memset(cart.ram, 0xFF, cart.ram_size);
+}
 
-	if (cart.rom != NULL) {
-		printf("Freeing previously read rom\n");
-		free(cart.rom);
-		cart.rom = NULL;
+// Banks are always read whole, and the two fixed ones are read even without
+// a mapper. A rom that doesn't end on a bank boundary, or has fewer than two,
+// gets a copy padded with 0xFF. Returns NULL if it can be used as it is.
+static struct HagemuRomImage *cart_pad_rom_image(struct HagemuRomImage *image) {
+	size_t size = rom_image_size(image);
+	size_t banks = (size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE;
+	if (banks < 2)
+		banks = 2;
+	if (size == banks * ROM_BANK_SIZE)
+		return NULL;
+
+	uint8_t *data = malloc(banks * ROM_BANK_SIZE);
+	if (data == NULL) {
+		fprintf(stderr, "Error: Failed to allocate the padded rom data\n");
+		exit(EXIT_FAILURE);
 	}
+	memcpy(data, rom_image_data(image), size);
+	memset(data + size, 0xFF, banks * ROM_BANK_SIZE - size);
+	struct HagemuRomImage *padded = rom_image_share(data, banks * ROM_BANK_SIZE);
+	free(data);
+	if (!padded) {
+		fprintf(stderr, "Error: Failed to allocate the padded rom data\n");
+		exit(EXIT_FAILURE);
+	}
+	return padded;
+}
 
+// The cart keeps its own reference to the image, so the caller can release theirs
+void cart_set_rom_image(struct HagemuRomImage *image) {
+	cart.rom_index = 1;
+	cart.ram_index = 0;
+	cart.ram_enabled = false;
+
+	// Retain first in case it's the same image. A padded copy already comes
+	// with its own reference.
+	size_t file_size = rom_image_size(image);
+	struct HagemuRomImage *padded = cart_pad_rom_image(image);
+	if (padded)
+		image = padded;
+	else
+		rom_image_retain(image);
+	rom_image_release(cart.rom_image);
+	cart.rom_image = image;
+	cart.rom = (const uint8_t (*)[ROM_BANK_SIZE])rom_image_data(image);
+	size_t size = rom_image_size(image);
+
+	memset(cart.sram_dirty, 0, sizeof(cart.sram_dirty));
 	if (cart.ram != NULL) {
 		printf("Freeing previous SRAM data\n");
-		free(cart.ram);
-		cart.ram = NULL;
+		cart_free_ram();
 	}
 
-	printf("Allocating space and copying the rom data\n");
-	cart.rom = malloc(size);
-	if (!cart.rom) {
-		fprintf(stderr, "Error: Failed to allocated the rom data\n");
+	if (!cart_set_info(&cart, size)) {
+		fprintf(stderr, "Error: The rom is too small to hold a cartridge header\n");
 		exit(EXIT_FAILURE);
 	}
-	memcpy(cart.rom, data, size);
-
-	cart_set_info(&cart);
 	printf("Rom title is %s\n", cart.title);
 	printf("Cartridge type is MBC%d\n", cart.info.type);
 	printf("ROM size is %zu KiB\n",  cart.rom_size / 1024);
@@ -177,8 +432,12 @@ void cart_set_rom(const uint8_t *data, size_t size) {
 	else
 		printf("RAM size is %zu KiB\n", cart.ram_size / 1024);
 
-	if (size != cart.rom_size)
-		printf("WARNING: Cartridge file is %zu bytes, but expected %zu bytes\n", size, cart.rom_size);
+	if (file_size != cart.rom_size)
+		printf("WARNING: Cartridge file is %zu bytes, but expected %zu bytes\n", file_size, cart.rom_size);
+	// The mappers wrap the bank number by the size, so they can't pick a
+	// bank past the end of a rom that's shorter than its header says
+	if (cart.rom_size > size)
+		cart.rom_size = size;
 
 	if (cart.ram_size == 0) {
 		printf("Cartridge contains no SRAM or RTC\n");
@@ -196,6 +455,7 @@ void cart_set_rom(const uint8_t *data, size_t size) {
 void cart_sram_reset(void) {
 	if (!cart.ram) return;
 	memset(cart.ram, 0xFF, cart.ram_size);
+	cart_mark_pages(0, cart.ram_size);
 	if (cart.info.has_timer)
 		rtc_reset();
 }
@@ -236,7 +496,7 @@ void cart_ram_write(uint16_t address, uint8_t value) {
 	if (!cart.ram && !cart.info.has_timer) return;
 
 	switch (cart.info.type) {
-	case NO_MBC: cart.ram[0][address] = value; break;
+	case NO_MBC: cart_ram_store(&cart, 0, address, value); break;
 	case MBC1:   cart_ram_write_mbc1(&cart, address, value); break;
 	case MBC2:   cart_ram_write_mbc2(&cart, address, value); break;
 	case MBC3:   cart_ram_write_mbc3(&cart, address, value); break;
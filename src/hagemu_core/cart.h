@@ -4,10 +4,18 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "core_types.h"
+
+struct HagemuRomImage;
 
 #define RAM_BANK_SIZE 0x2000
 #define ROM_BANK_SIZE 0x4000
 
+// SRAM changes are tracked in pages, so saving only has to write what changed.
+// 9 words cover the largest SRAM of 128 KiB plus the RTC data.
+#define SRAM_PAGE_SIZE   256
+#define SRAM_DIRTY_WORDS 9
+
 enum MBCType {
 	NO_MBC, MBC1, MBC2, MBC3, MBC4,
 	MBC5, MBC6, MBC7, MMM01, TAMA5,
@@ -24,7 +32,8 @@ struct HagemuCartInfo {
 
 struct HagemuCart {
 	struct HagemuCartInfo info;
-	uint8_t  (*rom)[ROM_BANK_SIZE];
+	const uint8_t (*rom)[ROM_BANK_SIZE];
+	struct HagemuRomImage *rom_image; // Holds the rom, which may be shared
 	uint8_t  (*ram)[RAM_BANK_SIZE];
 	size_t   rom_size;
 	size_t   ram_size;
@@ -34,10 +43,30 @@ struct HagemuCart {
 	bool     ram_enabled;
 	bool     mbc_banking_mode;
 	bool     rtc_latched;
+	bool     ram_mapped; // The ram is a shared mapping of the save file
+	uint64_t sram_dirty[SRAM_DIRTY_WORDS]; // One bit for every page
 };
 
+// Every write to the SRAM should go through here
+static inline void cart_ram_store(struct HagemuCart *cart, unsigned bank, uint16_t address, uint8_t value) {
+	if (cart->ram[bank][address] == value)
+		return;
+	cart->ram[bank][address] = value;
+	size_t page = (bank * RAM_BANK_SIZE + address) / SRAM_PAGE_SIZE;
+	cart->sram_dirty[page / 64] |= 1ull << (page % 64);
+}
+
+// The RTC registers are saved in the last bytes of the SRAM
+void cart_rtc_changed(struct HagemuCart *cart);
+
+bool cart_parse_header(const uint8_t *data, size_t size, struct HagemuRomHeader *header);
+// Of the loaded rom, false if there isn't one
+bool cart_get_header(struct HagemuRomHeader *header);
 void cart_set_rom(const uint8_t *data, size_t size);
+void cart_set_rom_image(struct HagemuRomImage *image);
+void cart_reset(void);
 bool cart_set_sram(const uint8_t *data, size_t size);
+bool cart_map_sram(const char *filename);
 
 void cart_rom_write(uint16_t address, uint8_t value);
 void cart_ram_write(uint16_t address, uint8_t value);
@@ -48,5 +77,6 @@ uint8_t cart_rom_read(uint16_t address);
 const uint8_t *cart_get_sram(size_t *out_size);
 bool cart_sram_available(void);
 void cart_sram_reset(void);
+unsigned cart_take_dirty_pages(uint16_t *pages, unsigned max_pages);
 
 #endif // HAGEMU_CART_H
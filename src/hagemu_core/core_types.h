@@ -1,6 +1,9 @@
 #ifndef HAGEMU_CORE_TYPES_H
 #define HAGEMU_CORE_TYPES_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 enum GBModel {
 	MODEL_DMG, // Original gameboy (default)
 	MODEL_CGB, // Gameboy color
@@ -8,4 +11,104 @@ enum GBModel {
 	MODEL_MGB, // Gameboy pocket
 };
 
+// Output formats the PPU can write the framebuffer in
+enum HagemuPixelFormat {
+	PIXEL_FORMAT_RGBA8888, // 4 bytes per pixel, red in the lowest byte (default)
+	PIXEL_FORMAT_RGB565,   // 2 bytes per pixel
+	PIXEL_FORMAT_GRAY8,    // 1 byte per pixel
+	PIXEL_FORMAT_INDEX2,   // 2 bits per pixel (0 is lightest), leftmost pixel in the high bits
+	PIXEL_FORMAT_YUV420,   // Planar Y, U and V (I420) with half resolution chroma
+};
+
+// Sample formats the APU can write audio in
+enum HagemuSampleFormat {
+	SAMPLE_FORMAT_FLOAT32, // In [-1.0, 1.0]
+	SAMPLE_FORMAT_INT16,
+};
+
+// A caller-owned buffer that the APU writes interleaved stereo audio into
+// instead of its own queue
+struct HagemuAudioOutput {
+	void *buffer;       // Holds capacity frames of two samples each
+	unsigned capacity;
+	enum HagemuSampleFormat format;
+	float gain;         // Applied to every sample before conversion
+};
+
+// Describes a downscaled grayscale copy of the screen that the PPU writes
+// line by line into a caller-owned buffer of width * height bytes
+struct HagemuObservationConfig {
+	uint8_t *buffer;
+	unsigned width;       // At most crop_width
+	unsigned height;      // At most crop_height
+	unsigned crop_x;
+	unsigned crop_y;
+	unsigned crop_width;
+	unsigned crop_height;
+	bool     area_average; // Average every covered pixel instead of the nearest one
+};
+
+// Caller-owned buffers that the APU writes separate audio streams into, at
+// the output sample rate. Each buffer holds capacity frames and can be NULL.
+struct HagemuAudioStems {
+	float *channels[4]; // Mono output of channels 1 to 4 after their DACs
+	float *mix;         // Interleaved left and right, same as the audio queue
+	unsigned capacity;
+};
+
+// Where the cartridge RTC gets the time from
+enum HagemuClockSource {
+	CLOCK_SOURCE_WALL,     // The host's clock, so time passes while the game is closed (default)
+	CLOCK_SOURCE_EMULATED, // The cycles the emulator ran, so replays and fast forward match
+	CLOCK_SOURCE_CALLBACK, // Whatever the callback returns
+};
+
+// Returns the current time in seconds. Saves store it as a unix time.
+typedef int64_t (*HagemuClockCallback)(void *userdata);
+
+// The cartridge header is inside the first 0x150 bytes of every ROM
+#define HAGEMU_HEADER_SIZE 0x150
+
+// What the cartridge header says about a game
+struct HagemuRomHeader {
+	char     title[17];       // +1 for the null terminator
+	uint8_t  cgb_flag;        // 0x80 also runs on GBC, 0xC0 is GBC only
+	uint8_t  cart_type;       // The raw cartridge type byte
+	uint8_t  mbc;             // 0 without one, 1 to 7 for MBC1 to MBC7, higher for others
+	uint8_t  header_checksum;
+	uint16_t global_checksum;
+	uint32_t rom_size;        // In bytes, 0 if the size byte is unknown
+	uint32_t ram_size;        // In bytes, including the saved RTC registers
+	bool     checksum_valid;  // The header checksum matches the header bytes
+	bool     supported;       // The core can run this cartridge type
+	bool     has_ram;
+	bool     has_battery;
+	bool     has_timer;
+	bool     has_rumble;
+};
+
+enum HagemuMovieState {
+	MOVIE_STATE_OFF,
+	MOVIE_STATE_RECORDING,
+	MOVIE_STATE_PLAYING,
+};
+
+// Progress of the input movie being recorded or played
+struct HagemuMovieInfo {
+	enum HagemuMovieState state;
+	uint64_t cycles;     // Run since the movie started, at the normal speed clock rate
+	unsigned frames;     // Completed since the movie started
+	unsigned keyframes;  // Written while recording, checked while playing
+	unsigned desyncs;    // Keyframes whose frame didn't match the recording
+	unsigned first_desync_frame;
+	bool     finished;   // Playback reached the end of the movie
+};
+
+// A horizontal run of pixels on one line that changed between frames
+struct HagemuDirtyRow {
+	uint8_t line;
+	uint8_t x_start;
+	uint8_t width;
+};
+
 #endif
@@ -0,0 +1,73 @@
+#include "delta.h"
+
+static inline unsigned pixel_size(enum HagemuPixelFormat format) {
+	switch (format) {
+	case PIXEL_FORMAT_RGBA8888: return 4;
+	case PIXEL_FORMAT_RGB565:   return 2;
+	case PIXEL_FORMAT_GRAY8:    return 1;
+	case PIXEL_FORMAT_INDEX2:   return 1;
+	default:                    return 0;
+	}
+}
+
+static inline uint32_t read_pixel(const uint8_t *frame, enum HagemuPixelFormat format, int line, int x) {
+	int offset = 160 * line + x;
+	switch (format) {
+	case PIXEL_FORMAT_RGBA8888:
+		return ((const uint32_t *)frame)[offset];
+	case PIXEL_FORMAT_RGB565:
+		return ((const uint16_t *)frame)[offset];
+	case PIXEL_FORMAT_GRAY8:
+		return frame[offset];
+	case PIXEL_FORMAT_INDEX2:
+		return (frame[offset / 4] >> (6 - 2 * (offset % 4))) & 0x03;
+	default:
+		return 0;
+	}
+}
+
+// Returns the number of bytes written, or 0 if the output buffer was too
+// small or the format can't be encoded
+size_t delta_encode(const uint8_t *frame, enum HagemuPixelFormat format,
+		    const struct HagemuDirtyRow *rows, unsigned row_count,
+		    uint8_t *output, size_t max_size) {
+	unsigned bytes_per_pixel = pixel_size(format);
+	if (bytes_per_pixel == 0 || max_size < 2)
+		return 0;
+
+	output[0] = row_count & 0xFF;
+	output[1] = row_count >> 8;
+	size_t size = 2;
+
+	for (unsigned r = 0; r < row_count; r++) {
+		int line    = rows[r].line;
+		int x_start = rows[r].x_start;
+		int width   = rows[r].width;
+
+		if (size + 3 > max_size)
+			return 0;
+		output[size++] = line;
+		output[size++] = x_start;
+		output[size++] = width;
+
+		int i = 0;
+		while (i < width) {
+			uint32_t pixel = read_pixel(frame, format, line, x_start + i);
+			int run_length = 1;
+			while (i + run_length < width && run_length < 255
+			       && read_pixel(frame, format, line, x_start + i + run_length) == pixel)
+				run_length++;
+
+			if (size + 1 + bytes_per_pixel > max_size)
+				return 0;
+			output[size++] = run_length;
+			for (unsigned b = 0; b < bytes_per_pixel; b++) {
+				output[size++] = pixel & 0xFF;
+				pixel >>= 8;
+			}
+			i += run_length;
+		}
+	}
+
+	return size;
+}
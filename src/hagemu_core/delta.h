@@ -0,0 +1,22 @@
+#ifndef HAGEMU_DELTA_H
+#define HAGEMU_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "core_types.h"
+
+// Delta frame layout (all values are little endian):
+//   uint16_t row_count
+//   For every row:
+//     uint8_t line, uint8_t x_start, uint8_t width
+//     Runs of (uint8_t length, pixel) until width pixels are covered
+//
+// A pixel is stored in the framebuffer's format, which is 4 bytes for
+// RGBA8888, 2 bytes for RGB565 and 1 byte for GRAY8. INDEX2 pixels are
+// unpacked to 1 byte each. YUV420 frames are planar and can't be encoded.
+
+size_t delta_encode(const uint8_t *frame, enum HagemuPixelFormat format,
+		    const struct HagemuDirtyRow *rows, unsigned row_count,
+		    uint8_t *output, size_t max_size);
+
+#endif
@@ -13,8 +13,16 @@ struct HagemuDMA {
 	uint8_t  index;
 	uint8_t  last_reg_write;
 	uint8_t  last_transferred;
+	bool     bulk;   // The source can't change, so the copy can be put off
+	uint8_t  synced; // How many bytes have actually been copied
 } dma = { 0 };
 
+// Only the DMA itself can access memory below HRAM while it's running, so
+// ROM and WRAM read the same no matter when the bytes are copied
+static bool dma_source_is_stable(uint16_t source) {
+	return source < 0x8000 || (source >= 0xC000 && source + 160 <= 0xFE00);
+}
+
 void dma_reset(void) {
 	memset(&dma, 0, sizeof(struct HagemuDMA));
 }
@@ -26,8 +34,27 @@ void dma_start(uint8_t value) {
 	dma.pending_cycles = 2;
 }
 
+void dma_sync(void) {
+	if (!dma.bulk || dma.synced == dma.index)
+		return;
+
+	uint8_t data[160];
+	unsigned length = dma.index - dma.synced;
+	for (unsigned i = 0; i < length; i++)
+		data[i] = mmu_read_nonblocking(dma.source + dma.synced + i);
+	ppu_oam_write_block(dma.synced, data, length);
+	dma.last_transferred = data[length - 1];
+	dma.synced = dma.index;
+}
+
 void dma_tick(void) {
-	if (dma.active) {
+	if (dma.active && dma.bulk) {
+		dma.index++;
+		if (dma.index == 160) {
+			dma_sync();
+			dma.active = false;
+		}
+	} else if (dma.active) {
 		dma.last_transferred = mmu_read_nonblocking(dma.source + dma.index);
 		ppu_oam_write_nonblocking(dma.index, dma.last_transferred);
 		dma.index++;
@@ -38,9 +65,13 @@ void dma_tick(void) {
 	if (dma.pending_cycles > 0) {
 		dma.pending_cycles--;
 		if (dma.pending_cycles == 0) {
+			// Finish copying what the last transfer got through
+			dma_sync();
 			dma.active = true;
 			dma.source = dma.last_reg_write << 8;
 			dma.index  = 0;
+			dma.synced = 0;
+			dma.bulk   = dma_source_is_stable(dma.source);
 		}
 	}
 }
@@ -49,6 +80,10 @@ bool dma_is_active(void) {
 	return dma.active;
 }
 
+bool dma_is_idle(void) {
+	return !dma.active && dma.pending_cycles == 0;
+}
+
 uint8_t dma_read(void) {
 	return dma.last_reg_write;
 }
@@ -7,7 +7,12 @@
 void dma_reset(void);
 void dma_start(uint8_t value);
 void dma_tick(void);
+// Copies the bytes that a bulk transfer has gotten through so far. Anything
+// that looks at OAM during a transfer has to call this first.
+void dma_sync(void);
 bool dma_is_active(void);
+// Whether the DMA isn't running and isn't about to start
+bool dma_is_idle(void);
 uint8_t dma_read(void);
 
 #endif
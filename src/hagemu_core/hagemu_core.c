@@ -6,9 +6,15 @@
 #include "joypad.h"
 #include "cart.h"
 #include "dma.h"
+#include "hdma.h"
 #include "mmu.h"
 #include "interrupt.h"
 #include "timer.h"
+#include "delta.h"
+#include "observation.h"
+#include "rom_image.h"
+#include "rtc.h"
+#include "movie.h"
 
 struct HagemuGB {
 	enum GBModel model;
@@ -22,18 +28,28 @@ struct HagemuGB* hagemu_create(void) {
 	return gb;
 }
 
-void hagemu_reset(struct HagemuGB* gb, enum GBModel model) {
+static void hagemu_power_on(struct HagemuGB *gb, enum GBModel model) {
 	cpu_reset(gb->cpu);
 	mmu_reset(gb->cpu);
 	ppu_reset();
 	apu_reset();
 	interrupt_reset();
 	dma_reset();
+	hdma_reset();
 	timer_reset();
+	rtc_reset_clock();
+	joypad_reset();
+	cart_reset();
 	mmu_set_model(model);
 	ppu_set_model(model);
 }
 
+void hagemu_reset(struct HagemuGB* gb, enum GBModel model) {
+	// The movie can't know about the reset
+	movie_stop();
+	hagemu_power_on(gb, model);
+}
+
 void hagemu_destroy(struct HagemuGB* gb) {
 	cpu_destroy(gb->cpu);
 	gb->cpu = NULL;
@@ -41,7 +57,11 @@ void hagemu_destroy(struct HagemuGB* gb) {
 }
 
 unsigned hagemu_next_instruction(struct HagemuGB* gb) {
-        return cpu_do_next_instruction(gb->cpu);
+	unsigned cycles = cpu_do_next_instruction(gb->cpu);
+	rtc_add_cycles(cycles);
+	if (movie.state != MOVIE_STATE_OFF)
+		movie_update(gb->cpu, cycles);
+	return cycles;
 }
 
 void hagemu_set_rom(struct HagemuGB *gb, enum GBModel model, const uint8_t *data, size_t size) {
@@ -50,10 +70,32 @@ void hagemu_set_rom(struct HagemuGB *gb, enum GBModel model, const uint8_t *data
 	hagemu_reset(gb, model);
 }
 
+bool hagemu_parse_header(const uint8_t *data, size_t size, struct HagemuRomHeader *out_header) {
+	return cart_parse_header(data, size, out_header);
+}
+
+struct HagemuRomImage *hagemu_rom_open(const char *filename) {
+	return rom_image_open(filename);
+}
+
+struct HagemuRomImage *hagemu_rom_share(const uint8_t *data, size_t size) {
+	return rom_image_share(data, size);
+}
+
+void hagemu_rom_release(struct HagemuRomImage *image) {
+	rom_image_release(image);
+}
+
+void hagemu_set_rom_image(struct HagemuGB *gb, enum GBModel model, struct HagemuRomImage *image) {
+	gb->model = model;
+	cart_set_rom_image(image);
+	hagemu_reset(gb, model);
+}
+
 void hagemu_run_frame(struct HagemuGB *gb) {
 	unsigned current_frame = ppu_get_frame_count();
 	while (ppu_get_frame_count() == current_frame) {
-		cpu_do_next_instruction(gb->cpu);
+		hagemu_next_instruction(gb);
 	}
 }
 
@@ -61,15 +103,85 @@ const uint32_t *hagemu_get_framebuffer(void) {
 	return ppu_get_frame();
 }
 
+uint64_t hagemu_get_frame_hash(uint64_t *out_audio_hash) {
+	return ppu_get_frame_hash(out_audio_hash);
+}
+
+const uint8_t *hagemu_get_frame_data(size_t *out_size) {
+	return ppu_get_frame_data(out_size);
+}
+
+bool hagemu_set_pixel_format(enum HagemuPixelFormat format) {
+	return ppu_set_pixel_format(format);
+}
+
+size_t hagemu_get_frame_size(void) {
+	return ppu_get_frame_size(ppu_get_pixel_format());
+}
+
+bool hagemu_set_frame_ring(uint8_t *const *slots, unsigned slot_count) {
+	return ppu_set_frame_slots(slots, slot_count);
+}
+
+unsigned hagemu_get_latest_frame(unsigned *out_sequence) {
+	return ppu_get_latest_frame_slot(out_sequence);
+}
+
+unsigned hagemu_get_frame_sequence(unsigned slot) {
+	return ppu_get_frame_sequence(slot);
+}
+
+unsigned hagemu_copy_frame(unsigned slot, uint8_t *output) {
+	return ppu_copy_frame_slot(slot, output);
+}
+
+bool hagemu_set_observation(const struct HagemuObservationConfig *config) {
+	return observation_configure(config);
+}
+
+void hagemu_set_deferred_rendering(bool deferred) {
+	ppu_set_deferred_rendering(deferred);
+}
+
+unsigned hagemu_get_dirty_rows(struct HagemuDirtyRow *rows) {
+	unsigned row_count = ppu_get_dirty_rows(rows);
+	ppu_clear_dirty_rows();
+	return row_count;
+}
+
+size_t hagemu_get_frame_delta(uint8_t *output, size_t max_size) {
+	struct HagemuDirtyRow rows[144];
+	unsigned row_count = ppu_get_dirty_rows(rows);
+	size_t frame_size;
+	const uint8_t *frame = ppu_get_frame_data(&frame_size);
+	size_t size = delta_encode(frame, ppu_get_pixel_format(), rows, row_count, output, max_size);
+	// Keep the changes around if they couldn't be written out
+	if (size > 0)
+		ppu_clear_dirty_rows();
+	return size;
+}
+
 unsigned hagemu_audio_read(float *buffer, unsigned max_frames) {
 	unsigned count = apu_read_audio(buffer, max_frames);
  	return count;
 }
 
+unsigned hagemu_audio_pull(float *buffer, unsigned frame_count) {
+	return apu_pull_audio(buffer, frame_count);
+}
+
 unsigned hagemu_audio_available(void) {
 	return apu_audio_available();
 }
 
+unsigned hagemu_audio_dropped(void) {
+	return apu_get_dropped_audio();
+}
+
+bool hagemu_set_audio_capacity(unsigned frame_count) {
+	return apu_set_audio_capacity(frame_count);
+}
+
 bool hagemu_set_sram(const uint8_t *data, size_t size) {
 	return cart_set_sram(data, size);
 }
@@ -82,6 +194,18 @@ const uint8_t *hagemu_get_sram(size_t *out_size) {
 	return cart_get_sram(out_size);
 }
 
+void hagemu_set_rtc_clock(enum HagemuClockSource source, HagemuClockCallback callback, void *userdata) {
+	rtc_set_clock(source, callback, userdata);
+}
+
+bool hagemu_map_sram(const char *filename) {
+	return cart_map_sram(filename);
+}
+
+unsigned hagemu_take_sram_dirty_pages(uint16_t *out_pages, unsigned max_pages) {
+	return cart_take_dirty_pages(out_pages, max_pages);
+}
+
 unsigned hagemu_get_frame_count(void) {
 	return ppu_get_frame_count();
 }
@@ -90,7 +214,69 @@ void hagemu_set_audio_sample_rate(unsigned new_sample_rate) {
 	apu_set_audio_sample_rate(new_sample_rate);
 }
 
+void hagemu_set_audio_rate_ratio(double ratio) {
+	apu_set_audio_rate_ratio(ratio);
+}
+
+void hagemu_set_audio_stems(const struct HagemuAudioStems *stems) {
+	apu_set_audio_stems(stems);
+}
+
+unsigned hagemu_take_audio_stems(void) {
+	return apu_take_audio_stems();
+}
+
+bool hagemu_set_audio_output(const struct HagemuAudioOutput *output) {
+	return apu_set_audio_output(output);
+}
+
+unsigned hagemu_take_audio_output(void) {
+	return apu_take_audio_output();
+}
+
+double hagemu_audio_average_skip(void) {
+	return apu_average_skip();
+}
+
+// Both start from a reset with the SRAM the movie holds, so that nothing but
+// the inputs can make the runs differ
+static bool hagemu_movie_begin(struct HagemuGB *gb) {
+	gb->model = movie.model;
+	hagemu_power_on(gb, gb->model);
+	if (movie.sram_size > 0 && !cart_set_sram(movie.sram, movie.sram_size)) {
+		movie_stop();
+		return false;
+	}
+	movie_begin(gb->cpu);
+	return true;
+}
+
+bool hagemu_movie_record(struct HagemuGB *gb, const char *filename, unsigned keyframe_interval) {
+	if (!movie_record_start(filename, gb->model, keyframe_interval))
+		return false;
+	return hagemu_movie_begin(gb);
+}
+
+bool hagemu_movie_play(struct HagemuGB *gb, const char *filename) {
+	if (!movie_play_start(filename))
+		return false;
+	return hagemu_movie_begin(gb);
+}
+
+void hagemu_movie_stop(void) {
+	movie_stop();
+}
+
+void hagemu_movie_get_info(struct HagemuMovieInfo *out_info) {
+	movie_get_info(out_info);
+}
+
 static inline void hagemu_set_button(struct HagemuGB *gb, HagemuButton button, bool is_down) {
+	// The movie holds the buttons until it ends
+	if (movie.state == MOVIE_STATE_PLAYING)
+		return;
+	if (movie.state == MOVIE_STATE_RECORDING)
+		movie_record_button(button, is_down);
 	joypad_set_button(button, is_down);
 	if (is_down) cpu_resume_if_stopped(gb->cpu);
 }
@@ -7,6 +7,7 @@
 #include <stddef.h>
 
 struct HagemuGB;
+struct HagemuRomImage;
 
 // setup and reset
 struct HagemuGB *hagemu_create(void);
@@ -19,22 +20,154 @@ void hagemu_run_frame(struct HagemuGB *gb);
 
 // Loading and saving files
 void hagemu_set_rom(struct HagemuGB *gb, enum GBModel model, const uint8_t *data, size_t size);
+
+// Read-only ROM images that are shared by everything running the same game.
+// The core keeps its own reference while it uses an image, so the caller can
+// release theirs right after hagemu_set_rom_image.
+// Maps the file where the platform allows it, so every process running the
+// game shares one copy. Opening the same file again returns the same image.
+struct HagemuRomImage *hagemu_rom_open(const char *filename);
+// Copies the data, or returns the loaded image with the same contents
+struct HagemuRomImage *hagemu_rom_share(const uint8_t *data, size_t size);
+void hagemu_rom_release(struct HagemuRomImage *image);
+void hagemu_set_rom_image(struct HagemuGB *gb, enum GBModel model, struct HagemuRomImage *image);
+
+// Fills out_header from the first HAGEMU_HEADER_SIZE bytes of a rom without
+// loading it. Returns false if size is smaller than that.
+bool hagemu_parse_header(const uint8_t *data, size_t size, struct HagemuRomHeader *out_header);
+
 bool hagemu_sram_available(void);
 bool hagemu_set_sram(const uint8_t *data, size_t size);
 const uint8_t *hagemu_get_sram(size_t *out_size);
 
+// Uses the save file itself as the cartridge RAM, with the RTC data at the
+// end as usual. Writes land in the file without any saving, and other
+// processes can read it while the game runs. Only works after loading a rom
+// and on platforms with mmap. Lasts until the next rom is loaded.
+bool hagemu_map_sram(const char *filename);
+
+// Chooses the clock for the cartridge RTC. The emulated clock counts the
+// cycles run since the last reset, so it needs no system calls and runs
+// the same at any speed. callback is only used with CLOCK_SOURCE_CALLBACK.
+// The RTC registers carry on from where they were with the new clock.
+void hagemu_set_rtc_clock(enum HagemuClockSource source, HagemuClockCallback callback, void *userdata);
+
+// The SRAM is tracked in pages of HAGEMU_SRAM_PAGE_SIZE bytes (the last one
+// may be shorter). Writes the index of every page that changed since the last
+// call into out_pages and marks them clean. Returns how many were written.
+// Read the pages from hagemu_get_sram afterwards.
+#define HAGEMU_SRAM_PAGE_SIZE 256
+unsigned hagemu_take_sram_dirty_pages(uint16_t *out_pages, unsigned max_pages);
+
+// The audio functions below may be called from a different thread than the
+// one running the core, as long as it's always the same one.
+
 // Consumes buffered audio, returns number of frames actually written
 unsigned hagemu_audio_read(float *output, unsigned max_frames);
 
+// Fills all frame_count frames, padding with silence if there isn't enough
+// audio yet. Meant for audio callbacks. Returns the number of real frames.
+unsigned hagemu_audio_pull(float *output, unsigned frame_count);
+
 // Returns the number of audio frames currently available for reading
 unsigned hagemu_audio_available(void);
 
+// Returns how many frames were dropped so far because the queue was full
+unsigned hagemu_audio_dropped(void);
+
+// Resizes the audio queue (default is 8192 frames, rounded up to a power of
+// two) and empties it. Nothing may be reading the audio while this is called.
+bool hagemu_set_audio_capacity(unsigned frame_count);
+
 // Change the audio sample rate (default is 48000Hz)
 void hagemu_set_audio_sample_rate(unsigned new_sample_rate);
 
+// Speeds up (> 1.0) or slows down (< 1.0) the sample rate by a tiny amount
+// to keep up with the audio device. This is cheap enough to call every frame.
+void hagemu_set_audio_rate_ratio(double ratio);
+
+// Also writes each channel and the mix into stems' buffers as the audio is
+// made. This needs no audio device, so it can run offline as fast as the core
+// does. Writing stops once the buffers are full. Passing NULL turns it off.
+void hagemu_set_audio_stems(const struct HagemuAudioStems *stems);
+// Returns the frames written since the last call and rewinds the buffers
+unsigned hagemu_take_audio_stems(void);
+
+// Makes the APU write finished audio straight into output->buffer in the
+// chosen format and gain, instead of into the queue read by hagemu_audio_read.
+// Frames that don't fit count as dropped. Passing NULL goes back to the queue.
+bool hagemu_set_audio_output(const struct HagemuAudioOutput *output);
+// Returns the frames written since the last call and rewinds the buffer
+unsigned hagemu_take_audio_output(void);
+
+// How many ticks the APU ran at once on average since the last reset. Only
+// meant for benchmarks, and only from the thread running the core.
+double hagemu_audio_average_skip(void);
+
 // Video functions
 unsigned hagemu_get_frame_count(void);
-const uint32_t* hagemu_get_framebuffer(void); // Pixel format is RGBA8888
+const uint32_t* hagemu_get_framebuffer(void); // Only valid for PIXEL_FORMAT_RGBA8888
+// 64-bit hash of the latest complete frame in the current pixel format. If
+// out_audio_hash isn't NULL, it gets a hash of the audio output during it.
+uint64_t hagemu_get_frame_hash(uint64_t *out_audio_hash);
+
+// The PPU writes frames directly in this format (default is RGBA8888). Fails
+// while a frame ring is registered, since its slots are sized for the old
+// format. Pass NULL to hagemu_set_frame_ring first and register it again after.
+bool hagemu_set_pixel_format(enum HagemuPixelFormat format);
+// Returns the latest frame in the current pixel format and its size in bytes
+const uint8_t *hagemu_get_frame_data(size_t *out_size);
+// Size in bytes of one frame in the current pixel format
+size_t hagemu_get_frame_size(void);
+
+// Makes the PPU draw into caller-owned memory, one frame per slot in turn.
+// Each of the 2 to 16 slots must be 4 byte aligned and hold a whole frame in
+// the current pixel format, which can't change until the ring is unregistered.
+// Passing NULL goes back to the internal double buffer.
+bool hagemu_set_frame_ring(uint8_t *const *slots, unsigned slot_count);
+// Returns the slot holding the latest complete frame and its sequence number
+unsigned hagemu_get_latest_frame(unsigned *out_sequence);
+// Returns the frame number held by a slot, or 0 while it's being drawn
+unsigned hagemu_get_frame_sequence(unsigned slot);
+// Copies a slot and returns its frame number. Safe to call from another
+// thread. Returns 0 if the slot was being drawn over during the copy, in
+// which case the copy is torn and the latest slot should be tried again.
+unsigned hagemu_copy_frame(unsigned slot, uint8_t *output);
+
+// Writes a cropped and downscaled grayscale copy of every frame into
+// config->buffer as the lines are drawn. The buffer holds a complete frame
+// once hagemu_run_frame returns. Passing NULL turns it off again.
+// Returns false if the sizes don't describe a downscale inside the screen.
+bool hagemu_set_observation(const struct HagemuObservationConfig *config);
+
+// Lines are only logged during the frame and drawn in a batch at VBLANK,
+// or earlier when the game changes VRAM, OAM or a palette mid-frame
+void hagemu_set_deferred_rendering(bool deferred);
+
+// Fills rows (must hold 144 entries) with the pixels that changed since the
+// last call to this function or hagemu_get_frame_delta. Returns the row count.
+unsigned hagemu_get_dirty_rows(struct HagemuDirtyRow *rows);
+
+// Serializes only the changed pixels of the current framebuffer as run-length
+// coded rows (see delta.h for the layout). Returns the number of bytes written,
+// or 0 if max_size is too small or the pixel format is YUV420.
+// HAGEMU_FRAME_DELTA_MAX_SIZE is always enough.
+#define HAGEMU_FRAME_DELTA_MAX_SIZE (2 + 144 * (3 + 160 * 5))
+size_t hagemu_get_frame_delta(uint8_t *output, size_t max_size);
+
+// Input movies record every joypad change with the cycle it happened at.
+// Recording and playing both reset the core, restore the SRAM the movie
+// started with and switch the RTC to the emulated clock until the movie
+// stops, so a movie plays out the same on any machine at any speed. While
+// playing, the movie owns the buttons until it ends. Resetting or loading a
+// rom stops the movie.
+// Every keyframe_interval frames (0 picks 60) a keyframe stores the hash of
+// the frame, and playback counts the keyframes that don't match.
+bool hagemu_movie_record(struct HagemuGB *gb, const char *filename, unsigned keyframe_interval);
+bool hagemu_movie_play(struct HagemuGB *gb, const char *filename);
+// Finishes writing a recording, or hands the buttons back during playback
+void hagemu_movie_stop(void);
+void hagemu_movie_get_info(struct HagemuMovieInfo *out_info);
 
 // Joystick controls
 void hagemu_set_button_a(struct HagemuGB *gb, bool is_down);
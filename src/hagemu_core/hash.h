@@ -0,0 +1,31 @@
+#ifndef HAGEMU_HASH_H
+#define HAGEMU_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// A fast 64-bit hash for spotting changes in frames and audio. It's not
+// meant to resist collisions that were made on purpose.
+
+#define HASH_SEED 0xCBF29CE484222325ull
+
+static inline uint64_t hash_mix(uint64_t hash, uint64_t value) {
+	hash ^= value;
+	hash *= 0x9E3779B97F4A7C15ull;
+	return hash ^ (hash >> 32);
+}
+
+static inline uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t size) {
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = hash_mix(hash, word);
+	}
+	for (; i < size; i++)
+		hash = hash_mix(hash, data[i]);
+	return hash_mix(hash, size);
+}
+
+#endif
@@ -1,7 +1,12 @@
 #include "dma.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "mmu.h"
+#include "ppu.h"
+
+// Every block takes 32 cycles at either speed
+#define HDMA_BLOCK_CYCLES 32
 
 struct HagemuHDMA {
 	uint16_t source;
@@ -11,14 +16,45 @@ struct HagemuHDMA {
 	bool     hblank_mode;
 	bool     active;  // actively transferring data
 	bool     enabled; // enabled but maybe not transferring
+	bool     block_copied; // The rest of this block was already copied
 } hdma = { 0 };
 
+void hdma_reset(void) {
+	memset(&hdma, 0, sizeof(struct HagemuHDMA));
+}
+
+// The CPU is stalled during a block. If the source can't change, the
+// OAM DMA can't get in the way, and the PPU won't change modes until the
+// block is done, then every byte lands the same as if it were copied on time.
+static bool hdma_block_is_safe(void) {
+	bool stable_source = hdma.source + 16 <= 0x8000
+		|| (hdma.source >= 0xC000 && hdma.source + 16 <= 0xFE00);
+	// The destination is only masked into VRAM when it's written. A long
+	// transfer counts past the end of the window and can wrap around to 0.
+	bool vram_dest = hdma.dest >= 0x8000 && hdma.dest <= 0xA000 - 16;
+	return stable_source
+		&& vram_dest
+		&& dma_is_idle()
+		&& ppu_vram_writable_for(HDMA_BLOCK_CYCLES);
+}
+
+static void hdma_copy_block(void) {
+	uint8_t data[16];
+	for (int i = 0; i < 16; i++)
+		data[i] = mmu_read_nonblocking(hdma.source + i);
+	ppu_vram_write_block(hdma.dest - 0x8000, data, 16);
+	hdma.block_copied = true;
+}
+
 // Transfers 1 byte of data
 void hdma_tick(void) {
 	if (!hdma.enabled || !hdma.active)
 		return;
 
-	mmu_write(hdma.dest, mmu_read(hdma.source));
+	if (hdma.countdown == 16 && hdma_block_is_safe())
+		hdma_copy_block();
+	if (!hdma.block_copied)
+		mmu_write(hdma.dest, mmu_read(hdma.source));
 
 	hdma.source++;
 	hdma.dest++;
@@ -28,6 +64,7 @@ void hdma_tick(void) {
 		return;
 
 	hdma.countdown = 16;
+	hdma.block_copied = false;
 
 	if (hdma.remaining_length == 0) {
 		hdma.remaining_length = 0x7F;
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+void hdma_reset(void);
 void hdma_tick(void);
 void hdma_write_register(uint16_t address, uint8_t value);
 uint8_t hdma_read_register(uint16_t address);
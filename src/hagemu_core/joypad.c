@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "joypad.h"
 #include "interrupt.h"
 
@@ -16,6 +17,10 @@ struct HagemuJoypad {
 	bool start;
 } joypad = { 0 };
 
+void joypad_reset(void) {
+	memset(&joypad, 0, sizeof(struct HagemuJoypad));
+}
+
 void joypad_set_button(HagemuButton button, bool is_down) {
 	bool *target = NULL;
 	switch (button) {
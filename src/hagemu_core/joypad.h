@@ -16,6 +16,7 @@ typedef enum HagemuButton {
 	JOYPAD_BUTTON_SELECT,
 } HagemuButton;
 
+void joypad_reset(void);
 uint8_t joypad_get_byte(void);
 void joypad_set_byte(uint8_t byte);
 void joypad_set_button(HagemuButton button, bool is_down);
@@ -46,11 +46,11 @@ void cart_ram_write_mbc1(struct HagemuCart *cart, uint16_t address, uint8_t valu
 	if (!cart->ram_enabled)
 		return;
 	else if (!cart->mbc_banking_mode) {
-		cart->ram[0][address] = value;
+		cart_ram_store(cart, 0, address, value);
 		return;
 	}
 	uint8_t ram_index = cart->ram_index % (cart->ram_size / RAM_BANK_SIZE);
-	cart->ram[ram_index][address] = value;
+	cart_ram_store(cart, ram_index, address, value);
 }
 
 uint8_t cart_ram_read_mbc1(struct HagemuCart *cart, uint16_t address) {
@@ -32,7 +32,7 @@ void cart_ram_write_mbc2(struct HagemuCart *cart, uint16_t address, uint8_t valu
 		return;
 	address %= 0x200;
 	value   |= 0xF0;
-	cart->ram[0][address] = value;
+	cart_ram_store(cart, 0, address, value);
 }
 
 uint8_t cart_ram_read_mbc2(struct HagemuCart *cart, uint16_t address) {
@@ -40,6 +40,7 @@ void cart_rom_write_mbc3(struct HagemuCart *cart, uint16_t address, uint8_t valu
 	// Latch the RTC clock
 	case 0x6000: case 0x7000:
 		rtc_set_latch(value & 0x01);
+		cart_rtc_changed(cart);
 		return;
 	}
 }
@@ -55,9 +56,11 @@ void cart_ram_write_mbc3(struct HagemuCart *cart, uint16_t address, uint8_t valu
 		return;
 
 	if (cart->ram_index < 0x08)
-		cart->ram[cart->ram_index][address] = value;
-	else
+		cart_ram_store(cart, cart->ram_index, address, value);
+	else {
 		rtc_write_register(cart->ram_index - 0x08, value);
+		cart_rtc_changed(cart);
+	}
 }
 
 uint8_t cart_ram_read_mbc3(struct HagemuCart *cart, uint16_t address) {
@@ -49,7 +49,7 @@ uint8_t cart_rom_read_mbc5(struct HagemuCart *cart, uint16_t address) {
 void cart_ram_write_mbc5(struct HagemuCart *cart, uint16_t address, uint8_t value) {
 	if (!cart->ram_enabled)
 		return;
-	cart->ram[cart->ram_index][address] = value;
+	cart_ram_store(cart, cart->ram_index, address, value);
 }
 
 uint8_t cart_ram_read_mbc5(struct HagemuCart *cart, uint16_t address) {
@@ -0,0 +1,419 @@
+#include "movie.h"
+#include <stdlib.h>
+#include <string.h>
+#include "cart.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "rtc.h"
+
+// Movie layout (all values are little endian):
+//   char     magic[4] ("HGMV")
+//   uint8_t  version, model, pixel_format, header_checksum
+//   uint16_t global_checksum
+//   char     title[16]
+//   uint32_t keyframe_interval
+//   uint32_t sram_size, then the SRAM with the RTC data at the end
+//   Records, each a tag byte followed by the cycles since the previous record
+//   as a varint (7 bits per byte, lowest first):
+//     MOVIE_RECORD_END
+//     MOVIE_RECORD_KEYFRAME, then the frame as a varint and its uint64_t hash
+//     MOVIE_RECORD_BUTTON | is_down << 3 | button
+#define MOVIE_MAGIC       "HGMV"
+#define MOVIE_VERSION     1
+#define MOVIE_HEADER_SIZE 34
+#define MOVIE_DEFAULT_KEYFRAME_INTERVAL 60
+
+#define MOVIE_RECORD_END      0x00
+#define MOVIE_RECORD_KEYFRAME 0x01
+#define MOVIE_RECORD_BUTTON   0x80
+#define MOVIE_MAX_RECORD_SIZE (1 + 10 + 10 + 8)
+
+struct HagemuMovie movie = { 0 };
+
+static void put_u16(uint8_t *out, uint16_t value) {
+	out[0] = value;
+	out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		out[i] = value >> (i * 8);
+}
+
+static uint32_t get_u32(const uint8_t *data) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++)
+		value |= (uint32_t)data[i] << (i * 8);
+	return value;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+	size_t size = 0;
+	while (value >= 0x80) {
+		out[size++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[size++] = value;
+	return size;
+}
+
+static bool movie_get_varint(uint64_t *out_value) {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (movie.position >= movie.size)
+			return false;
+		uint8_t byte = movie.data[movie.position++];
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			*out_value = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool movie_rom_header(struct HagemuRomHeader *header) {
+	if (!cart_get_header(header)) {
+		fprintf(stderr, "[ERROR] Input movies need a rom to be loaded first\n");
+		return false;
+	}
+	return true;
+}
+
+// Keeps the RTC from making runs differ
+static void movie_use_emulated_clock(void) {
+	rtc_get_clock(&movie.clock_source, &movie.clock_callback, &movie.clock_userdata);
+	movie.clock_saved = true;
+	rtc_set_clock(CLOCK_SOURCE_EMULATED, NULL, NULL);
+}
+
+static void movie_release(void) {
+	if (movie.clock_saved) {
+		rtc_set_clock(movie.clock_source, movie.clock_callback, movie.clock_userdata);
+		movie.clock_saved = false;
+	}
+	if (movie.file)
+		fclose(movie.file);
+	free(movie.sram);
+	free(movie.data);
+	movie.file = NULL;
+	movie.sram = NULL;
+	movie.data = NULL;
+	movie.state = MOVIE_STATE_OFF;
+}
+
+static void movie_write_record(uint8_t tag, unsigned frame, uint64_t hash) {
+	uint8_t record[MOVIE_MAX_RECORD_SIZE];
+	size_t size = 0;
+	record[size++] = tag;
+	size += put_varint(record + size, movie.cycles - movie.record_cycles);
+	if (tag == MOVIE_RECORD_KEYFRAME) {
+		size += put_varint(record + size, frame);
+		for (int i = 0; i < 8; i++)
+			record[size++] = hash >> (i * 8);
+	}
+	movie.record_cycles = movie.cycles;
+
+	if (fwrite(record, 1, size, movie.file) != size) {
+		fprintf(stderr, "[ERROR] Unable to write the input movie. Recording stopped.\n");
+		movie_release();
+	}
+}
+
+bool movie_record_start(const char *filename, enum GBModel model, unsigned keyframe_interval) {
+	movie_stop();
+	struct HagemuRomHeader rom;
+	if (!movie_rom_header(&rom))
+		return false;
+
+	// RAM without a battery is cleared by the reset, so it doesn't need saving
+	size_t sram_size = 0;
+	const uint8_t *sram = NULL;
+	if (rom.has_battery && cart_sram_available())
+		sram = cart_get_sram(&sram_size);
+
+	movie.sram = malloc(sram_size > 0 ? sram_size : 1);
+	if (movie.sram == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the input movie\n");
+		return false;
+	}
+	if (sram_size > 0)
+		memcpy(movie.sram, sram, sram_size);
+	movie.sram_size = sram_size;
+
+	movie.file = fopen(filename, "wb");
+	if (movie.file == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open file '%s'\n", filename);
+		movie_release();
+		return false;
+	}
+
+	movie.model = model;
+	movie.pixel_format = ppu_get_pixel_format();
+	movie.keyframe_interval = keyframe_interval > 0 ? keyframe_interval : MOVIE_DEFAULT_KEYFRAME_INTERVAL;
+
+	uint8_t header[MOVIE_HEADER_SIZE] = { 0 };
+	memcpy(header, MOVIE_MAGIC, 4);
+	header[4] = MOVIE_VERSION;
+	header[5] = movie.model;
+	header[6] = movie.pixel_format;
+	header[7] = rom.header_checksum;
+	put_u16(header + 8, rom.global_checksum);
+	memcpy(header + 10, rom.title, 16);
+	put_u32(header + 26, movie.keyframe_interval);
+	put_u32(header + 30, sram_size);
+	if (fwrite(header, 1, MOVIE_HEADER_SIZE, movie.file) != MOVIE_HEADER_SIZE
+	    || fwrite(movie.sram, 1, sram_size, movie.file) != sram_size) {
+		fprintf(stderr, "[ERROR] Unable to write file '%s'\n", filename);
+		movie_release();
+		return false;
+	}
+
+	movie_use_emulated_clock();
+	movie.state = MOVIE_STATE_RECORDING;
+	printf("Recording an input movie to '%s'\n", filename);
+	return true;
+}
+
+static bool movie_read_file(const char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open file '%s'\n", filename);
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	movie.data = (size > 0) ? malloc(size) : NULL;
+	if (movie.data == NULL || fread(movie.data, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "[ERROR] Unable to read file '%s'\n", filename);
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+	movie.size = size;
+	return true;
+}
+
+bool movie_play_start(const char *filename) {
+	movie_stop();
+	struct HagemuRomHeader rom;
+	if (!movie_rom_header(&rom))
+		return false;
+	if (!movie_read_file(filename)) {
+		movie_release();
+		return false;
+	}
+
+	const uint8_t *header = movie.data;
+	if (movie.size < MOVIE_HEADER_SIZE || memcmp(header, MOVIE_MAGIC, 4) != 0 || header[4] != MOVIE_VERSION) {
+		fprintf(stderr, "[ERROR] '%s' isn't an input movie this version can play\n", filename);
+		movie_release();
+		return false;
+	}
+
+	uint16_t global_checksum = header[8] | header[9] << 8;
+	if (header[7] != rom.header_checksum || global_checksum != rom.global_checksum
+	    || strncmp((const char *)header + 10, rom.title, 16) != 0) {
+		fprintf(stderr, "[ERROR] The input movie was recorded with a different rom than '%s'\n", rom.title);
+		movie_release();
+		return false;
+	}
+
+	movie.model = header[5];
+	movie.pixel_format = header[6];
+	movie.keyframe_interval = get_u32(header + 26);
+	movie.sram_size = get_u32(header + 30);
+	if (movie.model > MODEL_MGB || movie.sram_size > movie.size - MOVIE_HEADER_SIZE) {
+		fprintf(stderr, "[ERROR] The input movie '%s' is damaged\n", filename);
+		movie_release();
+		return false;
+	}
+
+	movie.sram = malloc(movie.sram_size > 0 ? movie.sram_size : 1);
+	if (movie.sram == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the input movie\n");
+		movie_release();
+		return false;
+	}
+	memcpy(movie.sram, movie.data + MOVIE_HEADER_SIZE, movie.sram_size);
+	movie.position = MOVIE_HEADER_SIZE + movie.sram_size;
+
+	movie_use_emulated_clock();
+	movie.state = MOVIE_STATE_PLAYING;
+	printf("Playing the input movie '%s'\n", filename);
+	return true;
+}
+
+// Returns false at the end of the data or if the record is damaged
+static bool movie_read_record(struct MovieRecord *record) {
+	if (movie.position >= movie.size) {
+		printf("The input movie ends without an end record\n");
+		return false;
+	}
+
+	uint64_t delta;
+	record->tag = movie.data[movie.position++];
+	if (!movie_get_varint(&delta))
+		goto damaged;
+	record->cycles = movie.record_cycles + delta;
+	movie.record_cycles = record->cycles;
+
+	if (record->tag == MOVIE_RECORD_KEYFRAME) {
+		uint64_t frame;
+		if (!movie_get_varint(&frame) || movie.size - movie.position < 8)
+			goto damaged;
+		record->frame = frame;
+		record->hash = 0;
+		for (int i = 0; i < 8; i++)
+			record->hash |= (uint64_t)movie.data[movie.position++] << (i * 8);
+	} else if (record->tag != MOVIE_RECORD_END && (record->tag & 0xF0) != MOVIE_RECORD_BUTTON) {
+		goto damaged;
+	}
+	return true;
+
+damaged:
+	fprintf(stderr, "[ERROR] The input movie is damaged after %zu bytes\n", movie.position);
+	return false;
+}
+
+static void movie_set_button(struct HagemuCPU *cpu, HagemuButton button, bool is_down) {
+	joypad_set_button(button, is_down);
+	if (is_down) {
+		cpu_resume_if_stopped(cpu);
+		movie.buttons |= 1 << button;
+	} else {
+		movie.buttons &= ~(1 << button);
+	}
+}
+
+static void movie_finish(void) {
+	printf("The input movie finished after %u frames", ppu_get_frame_count() - movie.start_frame);
+	if (movie.desyncs > 0)
+		printf(" with %u keyframes that didn't match\n", movie.desyncs);
+	else
+		printf(" and matched all %u keyframes\n", movie.keyframes);
+	movie.finished = true;
+	movie_stop();
+}
+
+static void movie_check_keyframe(const struct MovieRecord *record) {
+	unsigned frame = ppu_get_frame_count() - movie.start_frame;
+	// The hash depends on the pixel format, so only the frame can be compared
+	bool matches = (frame == record->frame);
+	if (movie.pixel_format == ppu_get_pixel_format())
+		matches = matches && ppu_get_frame_hash(NULL) == record->hash;
+
+	movie.keyframes++;
+	if (matches)
+		return;
+	if (movie.desyncs++ == 0) {
+		movie.first_desync_frame = frame;
+		printf("The input movie no longer matches the recording at frame %u\n", frame);
+	}
+}
+
+static void movie_play_records(struct HagemuCPU *cpu) {
+	while (movie.cycles >= movie.next.cycles) {
+		uint8_t tag = movie.next.tag;
+		if (tag == MOVIE_RECORD_END) {
+			movie_finish();
+			return;
+		} else if (tag == MOVIE_RECORD_KEYFRAME) {
+			movie_check_keyframe(&movie.next);
+		} else {
+			movie_set_button(cpu, tag & 0x07, tag & 0x08);
+		}
+
+		if (!movie_read_record(&movie.next)) {
+			movie_finish();
+			return;
+		}
+	}
+}
+
+void movie_begin(struct HagemuCPU *cpu) {
+	movie.cycles = 0;
+	movie.record_cycles = 0;
+	movie.start_frame = ppu_get_frame_count();
+	movie.last_frame = movie.start_frame;
+	movie.buttons = 0;
+	movie.keyframes = 0;
+	movie.desyncs = 0;
+	movie.first_desync_frame = 0;
+	movie.finished = false;
+
+	if (movie.state != MOVIE_STATE_PLAYING)
+		return;
+	if (movie.pixel_format != ppu_get_pixel_format())
+		printf("The pixel format differs from the recording, so only the frame count of keyframes is checked\n");
+	if (!movie_read_record(&movie.next)) {
+		movie_finish();
+		return;
+	}
+	movie_play_records(cpu);
+}
+
+void movie_stop(void) {
+	if (movie.state == MOVIE_STATE_OFF)
+		return;
+
+	movie.frames = ppu_get_frame_count() - movie.start_frame;
+	if (movie.state == MOVIE_STATE_RECORDING) {
+		movie_write_record(MOVIE_RECORD_END, 0, 0);
+		if (movie.file && fclose(movie.file) != 0)
+			fprintf(stderr, "[ERROR] Unable to finish writing the input movie\n");
+		else if (movie.file)
+			printf("Saved the input movie after %u frames\n", movie.frames);
+		movie.file = NULL;
+	} else {
+		// Let go of whatever the movie was holding down
+		for (int button = 0; button < 8; button++) {
+			if (movie.buttons & (1 << button))
+				joypad_set_button(button, false);
+		}
+	}
+	movie.buttons = 0;
+	movie_release();
+}
+
+void movie_record_button(HagemuButton button, bool is_down) {
+	uint8_t bit = 1 << button;
+	if (((movie.buttons & bit) != 0) == is_down)
+		return;
+	movie.buttons ^= bit;
+	movie_write_record(MOVIE_RECORD_BUTTON | is_down << 3 | button, 0, 0);
+}
+
+void movie_update(struct HagemuCPU *cpu, unsigned cycles) {
+	movie.cycles += cycles;
+	if (movie.state == MOVIE_STATE_PLAYING) {
+		if (movie.cycles >= movie.next.cycles)
+			movie_play_records(cpu);
+		return;
+	}
+
+	unsigned frame = ppu_get_frame_count();
+	if (frame == movie.last_frame)
+		return;
+	movie.last_frame = frame;
+	frame -= movie.start_frame;
+	if (frame % movie.keyframe_interval == 0) {
+		movie.keyframes++;
+		movie_write_record(MOVIE_RECORD_KEYFRAME, frame, ppu_get_frame_hash(NULL));
+		// Keeps the movie playable up to here if the emulator crashes
+		if (movie.file)
+			fflush(movie.file);
+	}
+}
+
+void movie_get_info(struct HagemuMovieInfo *out_info) {
+	out_info->state = movie.state;
+	out_info->cycles = movie.cycles;
+	out_info->frames = (movie.state != MOVIE_STATE_OFF) ? ppu_get_frame_count() - movie.start_frame : movie.frames;
+	out_info->keyframes = movie.keyframes;
+	out_info->desyncs = movie.desyncs;
+	out_info->first_desync_frame = movie.first_desync_frame;
+	out_info->finished = movie.finished;
+}
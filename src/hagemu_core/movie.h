@@ -0,0 +1,76 @@
+#ifndef HAGEMU_MOVIE_H
+#define HAGEMU_MOVIE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "core_types.h"
+#include "joypad.h"
+
+struct HagemuCPU;
+
+struct MovieRecord {
+	uint8_t  tag;
+	uint64_t cycles;  // Since the movie started
+	unsigned frame;   // Only for keyframes
+	uint64_t hash;
+};
+
+// An input movie is the SRAM the game started with and every joypad change
+// stamped with the cycle it happened at. The core is deterministic, so
+// pressing the same buttons at the same cycles plays the game out the same.
+// Every few frames a keyframe stores the frame's hash, which lets playback
+// tell exactly where it stopped matching the recording.
+struct HagemuMovie {
+	enum HagemuMovieState state;
+	uint64_t cycles;         // Since the movie started
+	uint64_t record_cycles;  // Of the last record written or read
+	unsigned start_frame;    // Frame count of the PPU when the movie started
+	unsigned last_frame;
+	unsigned keyframe_interval;
+	uint8_t  buttons;        // One bit for every button that's down
+
+	uint8_t  model;
+	uint8_t  pixel_format;
+	uint8_t *sram;           // What the game started with
+	size_t   sram_size;
+
+	FILE    *file;           // Only while recording
+
+	// The RTC clock from before the movie, put back once it stops
+	bool     clock_saved;
+	enum HagemuClockSource clock_source;
+	HagemuClockCallback clock_callback;
+	void    *clock_userdata;
+
+	uint8_t *data;           // The whole movie, only while playing
+	size_t   size;
+	size_t   position;       // Of the record after next
+	struct MovieRecord next; // Applied once the cycles reach it
+
+	unsigned frames;         // How long the movie ran once it stopped
+	unsigned keyframes;
+	unsigned desyncs;
+	unsigned first_desync_frame;
+	bool     finished;
+};
+
+extern struct HagemuMovie movie;
+
+// Writes the header, remembers the SRAM and switches the RTC to the emulated
+// clock. The caller resets the core next.
+bool movie_record_start(const char *filename, enum GBModel model, unsigned keyframe_interval);
+// Loads the whole movie, checks it belongs to the loaded rom and switches the
+// RTC to the emulated clock
+bool movie_play_start(const char *filename);
+// Called right after the reset. Applies the inputs of the first cycle.
+void movie_begin(struct HagemuCPU *cpu);
+void movie_stop(void);
+
+void movie_record_button(HagemuButton button, bool is_down);
+void movie_update(struct HagemuCPU *cpu, unsigned cycles);
+
+void movie_get_info(struct HagemuMovieInfo *out_info);
+
+#endif
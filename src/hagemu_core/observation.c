@@ -0,0 +1,113 @@
+#include "observation.h"
+#include <stdio.h>
+#include <string.h>
+
+struct HagemuObservation {
+	bool     enabled;
+	bool     area_average;
+	uint8_t *buffer;
+	unsigned width;
+	unsigned height;
+
+	// Source columns [col_start, col_end) that make up each output column
+	uint8_t col_start[160];
+	uint8_t col_end[160];
+	// Output row fed by each source line, or -1 if the line is cropped away
+	int16_t line_to_row[144];
+	// True if the line is the last one contributing to its output row
+	bool    line_ends_row[144];
+	uint8_t rows_per_output[144];
+
+	uint32_t row_sums[160];
+} observation = { 0 };
+
+bool observation_configure(const struct HagemuObservationConfig *config) {
+	if (config == NULL || config->buffer == NULL) {
+		observation.enabled = false;
+		return true;
+	}
+
+	// Compared without adding, so a huge crop_x or crop_y can't wrap around
+	if (config->crop_x > 160 || config->crop_width  > 160 - config->crop_x
+	    || config->crop_y > 144 || config->crop_height > 144 - config->crop_y
+	    || config->width  == 0 || config->width  > config->crop_width
+	    || config->height == 0 || config->height > config->crop_height) {
+		fprintf(stderr, "[ERROR] Invalid observation size %ux%u from a %ux%u crop at (%u, %u)\n",
+			config->width, config->height,
+			config->crop_width, config->crop_height, config->crop_x, config->crop_y);
+		observation.enabled = false;
+		return false;
+	}
+
+	observation.buffer       = config->buffer;
+	observation.width        = config->width;
+	observation.height       = config->height;
+	observation.area_average = config->area_average;
+
+	for (unsigned x = 0; x < config->width; x++) {
+		if (config->area_average) {
+			observation.col_start[x] = config->crop_x + x * config->crop_width / config->width;
+			observation.col_end[x]   = config->crop_x + (x + 1) * config->crop_width / config->width;
+		} else {
+			// Sample the source pixel closest to the center of the output pixel
+			observation.col_start[x] = config->crop_x + (2 * x + 1) * config->crop_width / (2 * config->width);
+			observation.col_end[x]   = observation.col_start[x] + 1;
+		}
+	}
+
+	for (unsigned line = 0; line < 144; line++) {
+		observation.line_to_row[line] = -1;
+		observation.line_ends_row[line] = false;
+	}
+
+	for (unsigned y = 0; y < config->height; y++) {
+		unsigned row_start, row_end;
+		if (config->area_average) {
+			row_start = config->crop_y + y * config->crop_height / config->height;
+			row_end   = config->crop_y + (y + 1) * config->crop_height / config->height;
+		} else {
+			row_start = config->crop_y + (2 * y + 1) * config->crop_height / (2 * config->height);
+			row_end   = row_start + 1;
+		}
+		for (unsigned line = row_start; line < row_end; line++)
+			observation.line_to_row[line] = y;
+		observation.line_ends_row[row_end - 1] = true;
+		observation.rows_per_output[y] = row_end - row_start;
+	}
+
+	memset(observation.row_sums, 0, sizeof(observation.row_sums));
+	observation.enabled = true;
+	return true;
+}
+
+bool observation_enabled(void) {
+	return observation.enabled;
+}
+
+// Called by the PPU with the grayscale values of every finished scanline
+void observation_write_line(int line, const uint8_t *luma) {
+	int row = observation.line_to_row[line];
+	if (row < 0)
+		return;
+
+	// The first line of an output row starts fresh
+	if (line == 0 || observation.line_to_row[line - 1] != row)
+		memset(observation.row_sums, 0, observation.width * sizeof(uint32_t));
+
+	for (unsigned x = 0; x < observation.width; x++) {
+		uint32_t sum = 0;
+		for (unsigned col = observation.col_start[x]; col < observation.col_end[x]; col++)
+			sum += luma[col];
+		observation.row_sums[x] += sum;
+	}
+
+	if (!observation.line_ends_row[line])
+		return;
+
+	uint8_t *output = observation.buffer + row * observation.width;
+	for (unsigned x = 0; x < observation.width; x++) {
+		unsigned area = observation.rows_per_output[row]
+			* (observation.col_end[x] - observation.col_start[x]);
+		output[x] = observation.row_sums[x] / area;
+	}
+}
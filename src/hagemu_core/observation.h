@@ -0,0 +1,12 @@
+#ifndef HAGEMU_OBSERVATION_H
+#define HAGEMU_OBSERVATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "core_types.h"
+
+bool observation_configure(const struct HagemuObservationConfig *config);
+bool observation_enabled(void);
+void observation_write_line(int line, const uint8_t *luma);
+
+#endif
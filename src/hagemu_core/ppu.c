@@ -6,18 +6,23 @@
 #include <stdlib.h>
 #include "interrupt.h"
 #include "hdma.h"
+#include "dma.h"
+#include "observation.h"
+#include "apu.h"
+#include "hash.h"
 
 #define PIXEL_DRAW_LENGTH 200
 #define SPRITE_LIMIT 10
 #define OAM_SPRITE_COUNT 40 // The number of sprites in OAM
+#define MAX_FRAME_SLOTS 16
 
 typedef uint16_t RGB555;
 typedef uint32_t ARGB8888;
 
 static void ppu_draw_scanline(void);
-static void ppu_draw_sprites(RGB555 *scanline, const bool *bg_nonzero, const bool *bg_priority);
-static void ppu_draw_background(RGB555 *scanline, bool *bg_nonzero, bool *bg_priority);
-static void ppu_draw_window(RGB555 *scanline, bool *bg_nonzero, bool *bg_priority);
+static void ppu_flush_lines(void);
+static void ppu_select_renderer(void);
+static void sprite_buckets_rebuild(void);
 
 // Green color palette from lightest to darkest
 static const RGB555 dmg_palette_colors[4] = {
@@ -82,13 +87,68 @@ struct Tile {
 	uint8_t data[8][2];
 };
 
+// Large enough for a frame in any of the supported pixel formats
+union FrameBuffer {
+	ARGB8888 rgba8888[144 * 160];
+	uint16_t rgb565[144 * 160];
+	uint8_t  bytes[144 * 160 * 4];
+};
+
+// Columns [start, end) of a line that changed. Empty when start >= end.
+struct DirtyRange {
+	uint8_t start;
+	uint8_t end;
+};
+
+// What a line is drawn with, captured from the registers at its HBLANK.
+// VRAM, OAM and the palettes aren't part of this, so logged lines are
+// drawn before any of them change.
+struct LineRegisters {
+	void (*draw_line)(const struct LineRegisters *regs);
+	uint8_t line;
+	uint8_t scroll_x;
+	uint8_t scroll_y;
+	uint8_t window_x;
+	uint8_t window_line;
+	bool window_visible; // triggered and on screen, if it's enabled
+	bool bg_enabled;
+	bool tall_sprites;
+	bool bg_tile_map;
+	bool bg_tile_data_area;
+	bool window_tile_map;
+};
+
 struct HagemuPPU {
 	enum PPUMode mode;
 	enum GBModel model;
 	unsigned frames_completed;
 	unsigned current_cycle;
 
-	ARGB8888 screen_buffer[2][144][160];
+	// Picked from the model and LCDC so that the drawing loops don't need
+	// to check either of them per pixel
+	void (*draw_line)(const struct LineRegisters *regs);
+	bool   color_correct;
+	RGB555 clear_color;
+
+	// Every palette resolved to colors. Rebuilt when a palette changes.
+	RGB555 bg_colors[8][4];
+	RGB555 obj_colors[8][4];
+	bool   palettes_dirty;
+
+	// Lines that have been captured but not drawn yet
+	struct LineRegisters line_log[144];
+	unsigned logged_lines;
+
+	// Hashes of the latest complete frame and the audio output during it
+	uint64_t frame_hash;
+	uint64_t audio_hash;
+
+	int chroma_sums[80][3]; // RGB sums of the last even line (YUV420 only)
+
+	// Changes in the frame being drawn compared to the previous frame
+	struct DirtyRange line_changes[144];
+	// Changes accumulated over all frames since the consumer last asked
+	struct DirtyRange pending_changes[144];
 
 	bool vram_bank;
 	// This corresponds exactly to the 8 kilobytes of VRAM
@@ -107,6 +167,9 @@ struct HagemuPPU {
 
 	// This correponds exactly to the 160 bytes of OAM RAM
 	struct Sprite sprites[OAM_SPRITE_COUNT];
+	// Bit i is set if sprite i covers the line. This is kept up to date on
+	// OAM writes since lines are drawn much more often than OAM changes.
+	uint64_t line_sprites[144];
 
 	// Used during scanline processing
 	uint8_t current_window_line;
@@ -123,7 +186,6 @@ struct HagemuPPU {
 	uint8_t win_scroll_x;
 
 	// Bools used during processing
-	bool buffer_index;
 	bool window_triggered;
 
 	// These correspond to the bits of the LCD_CONTROL register
@@ -145,18 +207,121 @@ struct HagemuPPU {
 	bool interrupt_select_LYC;      // bit 6
 } ppu = { 0 };
 
+// The default double buffer, used until the host registers its own slots
+static union FrameBuffer internal_frames[2];
+
+// Frames are written into a ring of slots, one frame per slot. This is set
+// up by the host, so unlike the rest of the PPU it survives a reset.
+struct PPUOutput {
+	enum HagemuPixelFormat pixel_format;
+	uint8_t *slots[MAX_FRAME_SLOTS];
+	unsigned sequences[MAX_FRAME_SLOTS]; // 0 while the slot is being drawn
+	unsigned slot_count;
+	unsigned back_slot;  // The slot currently being drawn
+	unsigned front_slot; // The latest complete frame
+	bool deferred_rendering;
+} output = {
+	.slots = { internal_frames[0].bytes, internal_frames[1].bytes },
+	.slot_count = 2,
+	.back_slot  = 0,
+	.front_slot = 1,
+};
+
+static inline uint8_t *back_frame(void) {
+	return output.slots[output.back_slot];
+}
+
+static inline const uint8_t *front_frame(void) {
+	return output.slots[output.front_slot];
+}
+
 void ppu_set_model(enum GBModel model) {
+	ppu_flush_lines();
 	ppu.model = model;
+	ppu.color_correct = (model == MODEL_CGB || model == MODEL_CGB_BACKCOMPAT);
+	// The DMG clears to light green, the others to white
+	ppu.clear_color = (model == MODEL_DMG) ? dmg_palette_colors[0] : 0x7FFF;
+	ppu.palettes_dirty = true;
+	ppu_select_renderer();
+}
+
+static void ppu_clear_frames(void) {
+	size_t frame_size = ppu_get_frame_size(output.pixel_format);
+	for (unsigned i = 0; i < output.slot_count; i++) {
+		memset(output.slots[i], 0, frame_size);
+		output.sequences[i] = 0;
+	}
+	output.back_slot  = 0;
+	output.front_slot = output.slot_count - 1;
 }
 
 void ppu_reset(void) {
 	memset(&ppu, 0, sizeof(struct HagemuPPU));
+	ppu_set_model(ppu.model);
+	ppu_clear_frames();
+}
+
+uint64_t ppu_get_frame_hash(uint64_t *out_audio_hash) {
+	if (out_audio_hash)
+		*out_audio_hash = ppu.audio_hash;
+	return ppu.frame_hash;
 }
 
 unsigned ppu_get_frame_count(void) {
 	return ppu.frames_completed;
 }
 
+static inline void dirty_mark(struct DirtyRange *range, int start, int end) {
+	if (range->start >= range->end) {
+		range->start = start;
+		range->end   = end;
+		return;
+	}
+	if (start < range->start)
+		range->start = start;
+	if (end > range->end)
+		range->end = end;
+}
+
+static void ppu_merge_dirty_ranges(void) {
+	for (int line = 0; line < 144; line++) {
+		struct DirtyRange current = ppu.line_changes[line];
+		if (current.start < current.end)
+			dirty_mark(&ppu.pending_changes[line], current.start, current.end);
+	}
+}
+
+unsigned ppu_get_dirty_rows(struct HagemuDirtyRow *rows) {
+	unsigned row_count = 0;
+	for (int line = 0; line < 144; line++) {
+		struct DirtyRange pending = ppu.pending_changes[line];
+		if (pending.start >= pending.end)
+			continue;
+		rows[row_count].line    = line;
+		rows[row_count].x_start = pending.start;
+		rows[row_count].width   = pending.end - pending.start;
+		row_count++;
+	}
+	return row_count;
+}
+
+void ppu_clear_dirty_rows(void) {
+	memset(ppu.pending_changes, 0, sizeof(ppu.pending_changes));
+}
+
+// Moves to the next slot once VBLANK starts. The release stores make sure
+// that a consumer on another thread that sees the new sequence number also
+// sees every pixel of the frame. The fence keeps the pixels drawn into the
+// next slot from showing up before its sequence number is cleared.
+static void ppu_publish_frame(void) {
+	unsigned next_slot = (output.back_slot + 1) % output.slot_count;
+	__atomic_store_n(&output.sequences[output.back_slot], ppu.frames_completed, __ATOMIC_RELEASE);
+	__atomic_store_n(&output.front_slot, output.back_slot, __ATOMIC_RELEASE);
+	__atomic_store_n(&output.sequences[next_slot], 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	output.back_slot = next_slot;
+}
+
 void ppu_tick(void) {
 	if (!ppu.enabled)
 		return;
@@ -202,9 +367,12 @@ void ppu_tick(void) {
 			interrupt_raise(LCD_INTERRUPT);
 		break;
 	case VBLANK:
-		// Swap buffers once VBLANK starts
-		ppu.buffer_index = !ppu.buffer_index;
+		ppu_flush_lines();
+		ppu.frame_hash = hash_bytes(HASH_SEED, back_frame(), ppu_get_frame_size(output.pixel_format));
+		ppu.audio_hash = apu_take_audio_hash();
+		ppu_merge_dirty_ranges();
 		ppu.frames_completed++;
+		ppu_publish_frame();
 		ppu.current_window_line = 0;
 		ppu.window_triggered = false;
 		if (ppu.interrupt_select_vblank)
@@ -214,88 +382,202 @@ void ppu_tick(void) {
 	}
 }
 
-static inline RGB555 read_pram(uint8_t palette_index, uint8_t color_index, bool is_sprite) {
-	uint8_t *pram = is_sprite ? ppu.sprite_pram : ppu.bg_pram;
+static inline RGB555 read_pram(const uint8_t *pram, int palette_index, int color_index) {
 	int offset = 2 * ((4 * palette_index) + color_index);
 	RGB555 color = (pram[offset+1] << 8) | pram[offset];
 	return color;
 }
 
-// In DMG mode, palette_reg is used. In CGB mode, palette_index is used.
-static RGB555 apply_color(bool dmg_palette_index, uint8_t palette_index, uint8_t color_index, bool is_sprite) {
-	if (ppu.model == MODEL_CGB)
-		return read_pram(palette_index, color_index, is_sprite);
+static inline uint8_t dmg_shade(uint8_t palette_reg, int color_index) {
+	return (palette_reg >> (2 * color_index)) & 0x03;
+}
 
-	uint8_t dmg_palette_reg;
-	if (!is_sprite)
-		dmg_palette_reg = ppu.bg_palette;
-	else if (dmg_palette_index == 0)
-		dmg_palette_reg = ppu.obj0_palette;
-	else
-		dmg_palette_reg = ppu.obj1_palette;
+// In CGB mode every palette comes from palette RAM. The other models map
+// colors through BGP/OBP0/OBP1 first, and sprites use palette 0 or 1.
+static void ppu_load_palettes(void) {
+	for (int p = 0; p < 8; p++) {
+		uint8_t obj_palette = (p & 0x01) ? ppu.obj1_palette : ppu.obj0_palette;
+		for (int c = 0; c < 4; c++) {
+			uint8_t bg_shade  = dmg_shade(ppu.bg_palette, c);
+			uint8_t obj_shade = dmg_shade(obj_palette, c);
+
+			switch (ppu.model) {
+			case MODEL_CGB:
+				ppu.bg_colors[p][c]  = read_pram(ppu.bg_pram, p, c);
+				ppu.obj_colors[p][c] = read_pram(ppu.sprite_pram, p, c);
+				break;
+			case MODEL_CGB_BACKCOMPAT:
+				ppu.bg_colors[p][c]  = read_pram(ppu.bg_pram, 0, bg_shade);
+				ppu.obj_colors[p][c] = read_pram(ppu.sprite_pram, p & 0x01, obj_shade);
+				break;
+			case MODEL_DMG:
+				ppu.bg_colors[p][c]  = dmg_palette_colors[bg_shade];
+				ppu.obj_colors[p][c] = dmg_palette_colors[obj_shade];
+				break;
+			case MODEL_MGB:
+				ppu.bg_colors[p][c]  = mgb_palette_colors[bg_shade];
+				ppu.obj_colors[p][c] = mgb_palette_colors[obj_shade];
+				break;
+			default:
+				fprintf(stderr, "Invalid GB model\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	ppu.palettes_dirty = false;
+}
 
-	uint8_t shade = (dmg_palette_reg >> (2 * color_index)) & 0x03;
+static inline ARGB8888 output_color(RGB555 c, bool color_correct) {
+	ARGB8888 color32 = convert_color(c);
+	if (color_correct)
+		color32 = correct_color(color32);
+	return color32;
+}
 
-	switch (ppu.model) {
-	case MODEL_CGB_BACKCOMPAT:
-		return read_pram(dmg_palette_index, shade, is_sprite);
-	case MODEL_DMG:
-		return dmg_palette_colors[shade];
-	case MODEL_MGB:
-		return mgb_palette_colors[shade];
-	default:
-		fprintf(stderr, "Invalid GB model\n");
-		exit(EXIT_FAILURE);
+static inline uint8_t color_luma(ARGB8888 c) {
+	uint32_t r = (c >> 0)  & 0xFF;
+	uint32_t g = (c >> 8)  & 0xFF;
+	uint32_t b = (c >> 16) & 0xFF;
+	return (77 * r + 150 * g + 29 * b) >> 8;
+}
+
+// On the DMG and MGB the shade is recovered exactly from the palette.
+// The color models have no real shades, so the uncorrected luma is quantized.
+static inline uint8_t color_shade(RGB555 c, bool color_correct) {
+	if (color_correct)
+		return 3 - (color_luma(convert_color(c)) >> 6);
+
+	const RGB555 *palette = (ppu.model == MODEL_DMG) ? dmg_palette_colors : mgb_palette_colors;
+	for (int shade = 0; shade < 3; shade++) {
+		if (palette[shade] == c)
+			return shade;
 	}
+	return 3;
 }
 
-static void ppu_clear_background(RGB555 *scanline) {
-	switch (ppu.model) {
-	// Draw a light green color
-	case MODEL_DMG:
-	for (int i = 0; i < 160; i++)
-		scanline[i] = dmg_palette_colors[0];
-	break;
+// The front buffer still holds the previous frame, so the changed pixels
+// are found while writing each line instead of diffing whole frames later
+static void write_line_rgba8888(int y, const RGB555 *scanline, bool color_correct, struct DirtyRange *changes) {
+	ARGB8888 *line = (ARGB8888 *)back_frame() + 160 * y;
+	const ARGB8888 *prev_line = (const ARGB8888 *)front_frame() + 160 * y;
 
-	// Draw a pure white color
-	case MODEL_MGB: case MODEL_CGB_BACKCOMPAT: case MODEL_CGB:
-	for (int i = 0; i < 160; i++)
-		scanline[i] = 0x7FFF;
-	break;
+	for (int i = 0; i < 160; i++) {
+		ARGB8888 color = output_color(scanline[i], color_correct);
+		if (color != prev_line[i])
+			dirty_mark(changes, i, i + 1);
+		line[i] = color;
 	}
 }
 
-static void ppu_draw_scanline(void) {
-	RGB555 scanline[160];
-	bool   bg_nonzero[160] = { 0 };
-	bool   bg_priority[160] = { 0 };
+static void write_line_rgb565(int y, const RGB555 *scanline, bool color_correct, struct DirtyRange *changes) {
+	uint16_t *line = (uint16_t *)back_frame() + 160 * y;
+	const uint16_t *prev_line = (const uint16_t *)front_frame() + 160 * y;
 
-	if (ppu.win_scroll_y == ppu.current_line)
-		ppu.window_triggered = true;
+	for (int i = 0; i < 160; i++) {
+		ARGB8888 c = output_color(scanline[i], color_correct);
+		uint16_t color =
+			((c << 8)  & 0xF800) | // red
+			((c >> 5)  & 0x07E0) | // green
+			((c >> 19) & 0x001F);  // blue
+		if (color != prev_line[i])
+			dirty_mark(changes, i, i + 1);
+		line[i] = color;
+	}
+}
 
-	ppu_draw_background(scanline, bg_nonzero, bg_priority);
-	if (ppu.window_enabled && ppu.window_triggered)
-		ppu_draw_window(scanline, bg_nonzero, bg_priority);
+static void write_line_gray8(int y, const RGB555 *scanline, bool color_correct, struct DirtyRange *changes) {
+	uint8_t *line = back_frame() + 160 * y;
+	const uint8_t *prev_line = front_frame() + 160 * y;
 
-	if (!ppu.bg_enabled) {
-		// The background doesn't clear on the CGB model
-		if (ppu.model != MODEL_CGB)
-			ppu_clear_background(scanline);
+	for (int i = 0; i < 160; i++) {
+		uint8_t color = color_luma(output_color(scanline[i], color_correct));
+		if (color != prev_line[i])
+			dirty_mark(changes, i, i + 1);
+		line[i] = color;
+	}
+}
 
-		for (int i = 0; i < 160; i++) {
-			bg_nonzero[i]  = 0;
-			bg_priority[i] = 0;
-		}
+static void write_line_index2(int y, const RGB555 *scanline, bool color_correct, struct DirtyRange *changes) {
+	uint8_t *line = back_frame() + 40 * y;
+	const uint8_t *prev_line = front_frame() + 40 * y;
+
+	for (int i = 0; i < 40; i++) {
+		uint8_t packed = 0;
+		for (int p = 0; p < 4; p++)
+			packed = (packed << 2) | color_shade(scanline[4 * i + p], color_correct);
+		if (packed != prev_line[i])
+			dirty_mark(changes, 4 * i, 4 * i + 4);
+		line[i] = packed;
 	}
+}
 
-	if (ppu.objects_enabled)
-		ppu_draw_sprites(scanline, bg_nonzero, bg_priority);
+// Uses the BT.601 limited range coefficients that video encoders expect.
+// Chroma is averaged over 2x2 blocks, so it's written on every odd line.
+static void write_line_yuv420(int y, const RGB555 *scanline, bool color_correct, struct DirtyRange *changes) {
+	uint8_t *frame = back_frame();
+	const uint8_t *prev_frame = front_frame();
+	bool odd_line = y & 0x01;
+	int y_offset = 160 * y;
 
 	for (int i = 0; i < 160; i++) {
-		ARGB8888 color32 = convert_color(scanline[i]);
-		if (ppu.model == MODEL_CGB || ppu.model == MODEL_CGB_BACKCOMPAT)
-			color32 = correct_color(color32);
-		ppu.screen_buffer[ppu.buffer_index][ppu.current_line][i] = color32;
+		ARGB8888 c = output_color(scanline[i], color_correct);
+		int r = (c >> 0)  & 0xFF;
+		int g = (c >> 8)  & 0xFF;
+		int b = (c >> 16) & 0xFF;
+
+		uint8_t luma = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+		if (luma != prev_frame[y_offset + i])
+			dirty_mark(changes, i, i + 1);
+		frame[y_offset + i] = luma;
+
+		int *sums = ppu.chroma_sums[i / 2];
+		if (!odd_line && i % 2 == 0) {
+			sums[0] = sums[1] = sums[2] = 0;
+		}
+		sums[0] += r;
+		sums[1] += g;
+		sums[2] += b;
+	}
+
+	if (!odd_line)
+		return;
+
+	int u_offset = 160 * 144 + 80 * (y / 2);
+	int v_offset = u_offset + 80 * 72;
+	for (int i = 0; i < 80; i++) {
+		int r = ppu.chroma_sums[i][0] / 4;
+		int g = ppu.chroma_sums[i][1] / 4;
+		int b = ppu.chroma_sums[i][2] / 4;
+		uint8_t u = ((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+		uint8_t v = ((112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+		if (u != prev_frame[u_offset + i] || v != prev_frame[v_offset + i]) {
+			// The chroma sample covers this line and the one above it
+			dirty_mark(changes, 2 * i, 2 * i + 2);
+			dirty_mark(changes - 1, 2 * i, 2 * i + 2);
+		}
+		frame[u_offset + i] = u;
+		frame[v_offset + i] = v;
+	}
+}
+
+static void ppu_write_scanline(int y, const RGB555 *scanline) {
+	bool color_correct = ppu.color_correct;
+	struct DirtyRange *changes = &ppu.line_changes[y];
+	changes->start = changes->end = 0;
+
+	switch (output.pixel_format) {
+	case PIXEL_FORMAT_RGBA8888: write_line_rgba8888(y, scanline, color_correct, changes); break;
+	case PIXEL_FORMAT_RGB565:   write_line_rgb565(y, scanline, color_correct, changes);   break;
+	case PIXEL_FORMAT_GRAY8:    write_line_gray8(y, scanline, color_correct, changes);    break;
+	case PIXEL_FORMAT_INDEX2:   write_line_index2(y, scanline, color_correct, changes);   break;
+	case PIXEL_FORMAT_YUV420:   write_line_yuv420(y, scanline, color_correct, changes);   break;
+	}
+
+	if (observation_enabled()) {
+		uint8_t luma[160];
+		for (int i = 0; i < 160; i++)
+			luma[i] = color_luma(output_color(scanline[i], color_correct));
+		observation_write_line(y, luma);
 	}
 }
 
@@ -317,36 +599,33 @@ static inline void tile_decode_row(struct Tile tile, int row, uint8_t out[8]) {
 	}
 }
 
-static void ppu_draw_background(RGB555 *scanline, bool *bg_nonzero, bool *bg_priority) {
-	int bg_row = (ppu.current_line + ppu.bg_scroll_y) % 256;
-	int bg_col = (ppu.bg_scroll_x) % 256;
-	int tile_row   = bg_row / 8;
-	int screen_col = 0;
+// Draws the background or window tiles from map position (map_x, map_y)
+// onwards, starting at screen_col and continuing to the end of the line
+static inline void draw_tile_row(RGB555 *scanline, bool *bg_nonzero, bool *bg_priority,
+				 bool tile_map, bool tile_data_area, int map_x, int map_y, int screen_col) {
+	int tile_row  = map_y / 8;
+	int pixel_row = map_y % 8;
 
 	while (screen_col < 160) {
-		int tile_col  = bg_col / 8;
-		int pixel_row = bg_row % 8;
-		int pixel_col = bg_col % 8;
+		int tile_col  = map_x / 8;
+		int pixel_col = map_x % 8;
 
 		int pixels_to_draw = 8 - pixel_col;
 		if (screen_col + pixels_to_draw > 160)
 			pixels_to_draw = 160 - screen_col;
 
-		uint8_t tile_index = ppu.tile_map[ppu.bg_tile_map][tile_row][tile_col];
-		uint8_t tile_attributes = ppu.bg_attributes[ppu.bg_tile_map][tile_row][tile_col];
+		uint8_t tile_index = ppu.tile_map[tile_map][tile_row][tile_col];
+		uint8_t tile_attributes = ppu.bg_attributes[tile_map][tile_row][tile_col];
 		bool priority = (tile_attributes >> 7) & 0x01;
 		bool y_flip = (tile_attributes >> 6) & 0x01;
 		bool x_flip = (tile_attributes >> 5) & 0x01;
 		bool bank_select = (tile_attributes >> 3) & 0x01;
-		uint8_t palette_index = tile_attributes & 0x07;
-
-		struct Tile tile = tile_get(tile_index, ppu.bg_tile_data_area, bank_select);
+		const RGB555 *colors = ppu.bg_colors[tile_attributes & 0x07];
 
-		if (y_flip)
-			pixel_row = 7 - pixel_row;
+		struct Tile tile = tile_get(tile_index, tile_data_area, bank_select);
 
 		uint8_t color_indices[8];
-		tile_decode_row(tile, pixel_row, color_indices);
+		tile_decode_row(tile, y_flip ? 7 - pixel_row : pixel_row, color_indices);
 
 		if (x_flip) {
 			for (int i = 0; i < 4; i++) {
@@ -358,87 +637,35 @@ static void ppu_draw_background(RGB555 *scanline, bool *bg_nonzero, bool *bg_pri
 
 		for (int p = 0; p < pixels_to_draw; p++) {
 			uint8_t color_index = color_indices[pixel_col + p];
-			scanline[screen_col] = apply_color(0, palette_index, color_index, false);
+			scanline[screen_col] = colors[color_index];
 			bg_priority[screen_col] = priority;
 			bg_nonzero[screen_col]  = (color_index != 0);
 			screen_col++;
 		}
 
-		bg_col = (bg_col + pixels_to_draw) % 256;
+		map_x = (map_x + pixels_to_draw) % 256;
 	}
 }
 
-static void ppu_draw_window(RGB555 *scanline, bool *bg_nonzero, bool *bg_priority) {
-	int win_row = ppu.current_window_line;
-	int win_col = 0;
-	int tile_row = win_row / 8;
-	int screen_col = ppu.win_scroll_x - 7;
-
-	// If the window isn't visible, exit early
-	if (screen_col >= 160)
-		return;
+static inline void ppu_draw_background(const struct LineRegisters *regs, RGB555 *scanline,
+				       bool *bg_nonzero, bool *bg_priority) {
+	int map_y = (regs->line + regs->scroll_y) % 256;
+	draw_tile_row(scanline, bg_nonzero, bg_priority, regs->bg_tile_map, regs->bg_tile_data_area,
+		      regs->scroll_x, map_y, 0);
+}
 
-	ppu.current_window_line++;
+static inline void ppu_draw_window(const struct LineRegisters *regs, RGB555 *scanline,
+				   bool *bg_nonzero, bool *bg_priority) {
+	int screen_col = regs->window_x - 7;
+	int map_x = 0;
 
 	if (screen_col < 0) {
-		win_col    = -screen_col;
+		map_x      = -screen_col;
 		screen_col = 0;
 	}
 
-	while (screen_col < 160) {
-		int tile_col  = win_col / 8;
-		int pixel_row = win_row % 8;
-		int pixel_col = win_col % 8;
-
-		int pixels_to_draw = 8 - pixel_col;
-		if (screen_col + pixels_to_draw > 160)
-			pixels_to_draw = 160 - screen_col;
-
-		uint8_t tile_index = ppu.tile_map[ppu.window_tile_map][tile_row][tile_col];
-		uint8_t tile_attributes = ppu.bg_attributes[ppu.window_tile_map][tile_row][tile_col];
-		bool priority = (tile_attributes >> 7) & 0x01;
-		bool y_flip = (tile_attributes >> 6) & 0x01;
-		bool x_flip = (tile_attributes >> 5) & 0x01;
-		bool bank_select = (tile_attributes >> 3) & 0x01;
-		uint8_t palette_index = tile_attributes & 0x07;
-
-		struct Tile tile = tile_get(tile_index, ppu.bg_tile_data_area, bank_select);
-
-		if (y_flip)
-			pixel_row = 7 - pixel_row;
-
-		uint8_t color_indices[8];
-		tile_decode_row(tile, pixel_row, color_indices);
-
-		if (x_flip) {
-			for (int i = 0; i < 4; i++) {
-				uint8_t temp = color_indices[i];
-				color_indices[i] = color_indices[7 - i];
-				color_indices[7 - i] = temp;
-			}
-		}
-
-		for (int p = 0; p < pixels_to_draw; p++) {
-			uint8_t color_index = color_indices[pixel_col + p];
-			scanline[screen_col] = apply_color(0, palette_index, color_index, false);
-			bg_priority[screen_col] = priority;
-			bg_nonzero[screen_col] = (color_index != 0);
-			screen_col++;
-		}
-
-		win_col += pixels_to_draw;
-	}
-}
-
-static bool sprite_is_visible(struct Sprite *sprite) {
-	if (ppu.current_line < (int)sprite->y_position - 16)
-		return false;
-	else if (ppu.current_line < (int)sprite->y_position - 8)
-		return true;
-	else if (ppu.use_tall_sprites && ppu.current_line < (int)sprite->y_position)
-		return true;
-	else
-		return false;
+	draw_tile_row(scanline, bg_nonzero, bg_priority, regs->window_tile_map, regs->bg_tile_data_area,
+		      map_x, regs->window_line, screen_col);
 }
 
 // I'm writing my own sorting algorithm because I need to guarantee that
@@ -457,21 +684,21 @@ static void sprite_sort_x_position(struct Sprite *sprites, unsigned sprite_count
 	}
 }
 
-static unsigned read_sprites(struct Sprite *sprites) {
+// The lowest bits come first, so the sprites are read in OAM order
+static unsigned read_sprites(int line, struct Sprite *sprites) {
+	uint64_t candidates = ppu.line_sprites[line];
 	unsigned sprite_count = 0;
-	for (int i = 0; i < OAM_SPRITE_COUNT; i++) {
-		if (sprite_count >= SPRITE_LIMIT)
-			break;
-		struct Sprite *sprite = &ppu.sprites[i];
-		if (sprite_is_visible(sprite)) {
-			sprites[sprite_count] = *sprite;
-			sprite_count++;
-		}
+	while (candidates && sprite_count < SPRITE_LIMIT) {
+		sprites[sprite_count] = ppu.sprites[__builtin_ctzll(candidates)];
+		sprite_count++;
+		candidates &= candidates - 1;
 	}
 	return sprite_count;
 }
 
-static void draw_sprite(RGB555 *scanline, const bool *bg_nonzero, const bool *bg_priority, struct Sprite sprite) {
+// bg_over_sprites is set wherever the background is drawn over every sprite
+static inline void draw_sprite(const struct LineRegisters *regs, RGB555 *scanline, const bool *bg_nonzero,
+			       const bool *bg_over_sprites, struct Sprite sprite, bool cgb) {
 	bool background_has_priority = (sprite.attributes >> 7) & 0x01;
 	bool y_flip = (sprite.attributes >> 6) & 0x01;
 	bool x_flip = (sprite.attributes >> 5) & 0x01;
@@ -479,16 +706,17 @@ static void draw_sprite(RGB555 *scanline, const bool *bg_nonzero, const bool *bg
 	bool bank_select    = (sprite.attributes >> 3) & 0x01;
 	uint8_t tile_index  = sprite.tile_index;
 	uint8_t palette_index = sprite.attributes & 0x07;
+	const RGB555 *colors = ppu.obj_colors[cgb ? palette_index : palette_select];
 
-	int sprite_row = ppu.current_line - (int)sprite.y_position + 16;
-	if (y_flip && ppu.use_tall_sprites)
+	int sprite_row = regs->line - (int)sprite.y_position + 16;
+	if (y_flip && regs->tall_sprites)
 		sprite_row = 15 - sprite_row;
 	else if (y_flip)
 		sprite_row = 7 - sprite_row;
 
-	if (ppu.use_tall_sprites && sprite_row < 8)
+	if (regs->tall_sprites && sprite_row < 8)
 		tile_index &= ~(0x01);
-	else if (ppu.use_tall_sprites && sprite_row < 16) {
+	else if (regs->tall_sprites && sprite_row < 16) {
 		tile_index |= 0x01;
 		sprite_row -= 8;
 	}
@@ -496,44 +724,267 @@ static void draw_sprite(RGB555 *scanline, const bool *bg_nonzero, const bool *bg
 	uint8_t color_indices[8];
 	struct Tile tile = tile_get(tile_index, true, bank_select);
 	tile_decode_row(tile, sprite_row, color_indices);
+
+
+	const bool *hidden = background_has_priority ? bg_nonzero : bg_over_sprites;
 	for (int i = 0; i < 8; i++) {
 		int col = (int)sprite.x_position + i - 8;
 		uint8_t sprite_col = x_flip ? 7 - i : i;
 
 		if (col < 0 || col >= 160)
 			continue;
-		else if ((background_has_priority || bg_priority[col]) && bg_nonzero[col])
+		else if (hidden[col])
 			continue;
 		else if (color_indices[sprite_col] == 0)
 			continue;
 
-		scanline[col] = apply_color(palette_select, palette_index, color_indices[sprite_col], true);
+		scanline[col] = colors[color_indices[sprite_col]];
 	}
 }
 
-static void ppu_draw_sprites(RGB555 *scanline, const bool *bg_nonzero, const bool *bg_priority) {
+// Sprites are drawn in OAM order on the CGB and in X order on the others
+static inline void ppu_draw_sprites(const struct LineRegisters *regs, RGB555 *scanline,
+				    const bool *bg_nonzero, const bool *bg_priority, bool cgb) {
 	struct Sprite sprites[SPRITE_LIMIT];
-	unsigned sprite_count = read_sprites(sprites);
+	unsigned sprite_count = read_sprites(regs->line, sprites);
+
+	if (sprite_count == 0)
+		return;
 
-	if (ppu.model != MODEL_CGB) {
+	if (!cgb)
 		sprite_sort_x_position(sprites, sprite_count);
-	}
+
+	// Background pixels with the priority attribute hide every sprite
+	bool bg_over_sprites[160];
+	for (int col = 0; col < 160; col++)
+		bg_over_sprites[col] = bg_priority[col] && bg_nonzero[col];
 
 	// Draw the sprites backwards so that earlier sprites have higher priority
 	for (int i = sprite_count - 1; i >= 0; i--) {
-		draw_sprite(scanline, bg_nonzero, bg_priority, sprites[i]);
+		draw_sprite(regs, scanline, bg_nonzero, bg_over_sprites, sprites[i], cgb);
+	}
+}
+
+// The generic scanline renderer. It's only ever called with constant
+// arguments below, so each use gets compiled into its own specialized copy.
+static inline void draw_scanline_template(const struct LineRegisters *regs, bool cgb, bool window, bool sprites) {
+	RGB555 scanline[160];
+	bool   bg_nonzero[160];
+	bool   bg_priority[160];
+
+	if (!regs->bg_enabled && !cgb) {
+		// Only the CGB keeps drawing the background when it's disabled
+		for (int i = 0; i < 160; i++) {
+			scanline[i]    = ppu.clear_color;
+			bg_nonzero[i]  = false;
+			bg_priority[i] = false;
+		}
+	} else {
+		ppu_draw_background(regs, scanline, bg_nonzero, bg_priority);
+		if (window && regs->window_visible)
+			ppu_draw_window(regs, scanline, bg_nonzero, bg_priority);
+
+		// The background loses its priority over sprites
+		if (!regs->bg_enabled) {
+			memset(bg_nonzero,  0, sizeof(bg_nonzero));
+			memset(bg_priority, 0, sizeof(bg_priority));
+		}
 	}
+
+	if (sprites)
+		ppu_draw_sprites(regs, scanline, bg_nonzero, bg_priority, cgb);
+
+	ppu_write_scanline(regs->line, scanline);
+}
+
+#define DEFINE_SCANLINE_RENDERER(name, cgb, window, sprites) \
+	static void name(const struct LineRegisters *regs) { draw_scanline_template(regs, cgb, window, sprites); }
+
+DEFINE_SCANLINE_RENDERER(draw_line_dmg,                    false, false, false)
+DEFINE_SCANLINE_RENDERER(draw_line_dmg_sprites,            false, false, true)
+DEFINE_SCANLINE_RENDERER(draw_line_dmg_window,             false, true,  false)
+DEFINE_SCANLINE_RENDERER(draw_line_dmg_window_sprites,     false, true,  true)
+DEFINE_SCANLINE_RENDERER(draw_line_cgb,                    true,  false, false)
+DEFINE_SCANLINE_RENDERER(draw_line_cgb_sprites,            true,  false, true)
+DEFINE_SCANLINE_RENDERER(draw_line_cgb_window,             true,  true,  false)
+DEFINE_SCANLINE_RENDERER(draw_line_cgb_window_sprites,     true,  true,  true)
+
+// Indexed by [is CGB][window enabled][sprites enabled]
+static void (*const scanline_renderers[2][2][2])(const struct LineRegisters *regs) = {
+	{ { draw_line_dmg, draw_line_dmg_sprites }, { draw_line_dmg_window, draw_line_dmg_window_sprites } },
+	{ { draw_line_cgb, draw_line_cgb_sprites }, { draw_line_cgb_window, draw_line_cgb_window_sprites } },
+};
+
+// Called whenever the model or LCDC changes
+static void ppu_select_renderer(void) {
+	ppu.draw_line = scanline_renderers[ppu.model == MODEL_CGB][ppu.window_enabled][ppu.objects_enabled];
+}
+
+// Draws every logged line. This has to happen before anything that the
+// logged lines read besides their registers changes.
+static void ppu_flush_lines(void) {
+	if (ppu.logged_lines == 0)
+		return;
+
+	if (ppu.palettes_dirty)
+		ppu_load_palettes();
+
+	for (unsigned i = 0; i < ppu.logged_lines; i++) {
+		const struct LineRegisters *regs = &ppu.line_log[i];
+		regs->draw_line(regs);
+	}
+	ppu.logged_lines = 0;
+}
+
+static void ppu_draw_scanline(void) {
+	// The line has to see the sprites that the DMA has copied by now
+	dma_sync();
+
+	if (ppu.win_scroll_y == ppu.current_line)
+		ppu.window_triggered = true;
+
+	if (ppu.logged_lines == 144)
+		ppu_flush_lines();
+
+	struct LineRegisters *regs = &ppu.line_log[ppu.logged_lines++];
+	regs->draw_line         = ppu.draw_line;
+	regs->line              = ppu.current_line;
+	regs->scroll_x          = ppu.bg_scroll_x;
+	regs->scroll_y          = ppu.bg_scroll_y;
+	regs->window_x          = ppu.win_scroll_x;
+	regs->window_line       = ppu.current_window_line;
+	regs->window_visible    = ppu.window_triggered && ppu.win_scroll_x < 160 + 7;
+	regs->bg_enabled        = ppu.bg_enabled;
+	regs->tall_sprites      = ppu.use_tall_sprites;
+	regs->bg_tile_map       = ppu.bg_tile_map;
+	regs->bg_tile_data_area = ppu.bg_tile_data_area;
+	regs->window_tile_map   = ppu.window_tile_map;
+
+	// The window only counts the lines that it's drawn on
+	if (ppu.window_enabled && regs->window_visible)
+		ppu.current_window_line++;
+
+	if (!output.deferred_rendering)
+		ppu_flush_lines();
+}
+
+// Deferred lines are drawn in a batch at VBLANK, or earlier if VRAM, OAM
+// or a palette is about to change under them
+void ppu_set_deferred_rendering(bool deferred) {
+	output.deferred_rendering = deferred;
+	if (!deferred)
+		ppu_flush_lines();
 }
 
 const uint32_t* ppu_get_frame(void) {
-	return (const uint32_t*)ppu.screen_buffer[!ppu.buffer_index];
+	return (const uint32_t *)front_frame();
+}
+
+const uint8_t *ppu_get_frame_data(size_t *out_size) {
+	*out_size = ppu_get_frame_size(output.pixel_format);
+	return front_frame();
+}
+
+size_t ppu_get_frame_size(enum HagemuPixelFormat format) {
+	switch (format) {
+	case PIXEL_FORMAT_RGBA8888: return 160 * 144 * 4;
+	case PIXEL_FORMAT_RGB565:   return 160 * 144 * 2;
+	case PIXEL_FORMAT_GRAY8:    return 160 * 144;
+	case PIXEL_FORMAT_INDEX2:   return 160 * 144 / 4;
+	case PIXEL_FORMAT_YUV420:   return 160 * 144 + 2 * (80 * 72);
+	}
+	return 0;
+}
+
+enum HagemuPixelFormat ppu_get_pixel_format(void) {
+	return output.pixel_format;
+}
+
+// Whatever the consumer saw before is stale, so every line is dirty
+static void ppu_mark_all_dirty(void) {
+	for (int line = 0; line < 144; line++) {
+		ppu.pending_changes[line].start = 0;
+		ppu.pending_changes[line].end   = 160;
+	}
+}
+
+// The host's slots were sized for the old format, so changing it is refused
+// until they're unregistered
+bool ppu_set_pixel_format(enum HagemuPixelFormat format) {
+	if (format == output.pixel_format)
+		return true;
+	if (output.slots[0] != internal_frames[0].bytes) {
+		fprintf(stderr, "[ERROR] The pixel format can't change while a frame ring is registered\n");
+		return false;
+	}
+	ppu_flush_lines();
+	output.pixel_format = format;
+	ppu_clear_frames();
+	ppu_mark_all_dirty();
+	return true;
+}
+
+// Slots must be 4 byte aligned and hold a full frame in the pixel format.
+// Passing NULL switches back to the internal double buffer.
+bool ppu_set_frame_slots(uint8_t *const *slots, unsigned slot_count) {
+	if (slots != NULL && (slot_count < 2 || slot_count > MAX_FRAME_SLOTS)) {
+		fprintf(stderr, "[ERROR] A frame ring needs between 2 and %d slots, not %u\n",
+			MAX_FRAME_SLOTS, slot_count);
+		return false;
+	}
+
+	ppu_flush_lines();
+	if (slots != NULL) {
+		for (unsigned i = 0; i < slot_count; i++)
+			output.slots[i] = slots[i];
+		output.slot_count = slot_count;
+	} else {
+		output.slots[0] = internal_frames[0].bytes;
+		output.slots[1] = internal_frames[1].bytes;
+		output.slot_count = 2;
+	}
+
+	ppu_clear_frames();
+	ppu_mark_all_dirty();
+	return true;
+}
+
+unsigned ppu_get_latest_frame_slot(unsigned *out_sequence) {
+	unsigned slot = __atomic_load_n(&output.front_slot, __ATOMIC_ACQUIRE);
+	*out_sequence = __atomic_load_n(&output.sequences[slot], __ATOMIC_ACQUIRE);
+	return slot;
+}
+
+unsigned ppu_get_frame_sequence(unsigned slot) {
+	if (slot >= output.slot_count)
+		return 0;
+	return __atomic_load_n(&output.sequences[slot], __ATOMIC_ACQUIRE);
+}
+
+// The fence keeps the reads of the copy from moving past the second check
+unsigned ppu_copy_frame_slot(unsigned slot, uint8_t *destination) {
+	if (slot >= output.slot_count)
+		return 0;
+	unsigned sequence = __atomic_load_n(&output.sequences[slot], __ATOMIC_ACQUIRE);
+	if (sequence == 0)
+		return 0;
+	memcpy(destination, output.slots[slot], ppu_get_frame_size(output.pixel_format));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&output.sequences[slot], __ATOMIC_RELAXED) != sequence)
+		return 0;
+	return sequence;
 }
 
 /*** Below is code for reading and writing to registers ***/
 
 void ppu_set_lcd_control(uint8_t value) {
-	ppu.lcd_control_raw = value;
+	// Turning off the LCD or resizing sprites changes what logged lines see
 	bool old_ppu_state = ppu.enabled;
+	bool old_tall_sprites = ppu.use_tall_sprites;
+	if (!(value & (1u << 7)) || ((value >> 2) & 0x01) != old_tall_sprites)
+		ppu_flush_lines();
+
+	ppu.lcd_control_raw = value;
 
 	ppu.bg_enabled        = value & (1u << 0);
 	ppu.objects_enabled   = value & (1u << 1);
@@ -544,6 +995,11 @@ void ppu_set_lcd_control(uint8_t value) {
 	ppu.window_tile_map   = value & (1u << 6);
 	ppu.enabled           = value & (1u << 7);
 
+	// Every sprite covers a different number of lines now
+	if (old_tall_sprites != ppu.use_tall_sprites)
+		sprite_buckets_rebuild();
+	ppu_select_renderer();
+
 	if (old_ppu_state == ppu.enabled)
 		return;
 
@@ -617,14 +1073,16 @@ void ppu_register_write(uint16_t address, uint8_t value) {
 	case REG_BG_SCROLL_Y:  ppu.bg_scroll_y  = value;   break;
 	case REG_BG_SCROLL_X:  ppu.bg_scroll_x  = value;   break;
 	case REG_LCD_Y_COORD:  break; // this register is read-only
-	case REG_BG_PALETTE:   ppu.bg_palette   = value;   break;
-	case REG_OBJ0_PALETTE: ppu.obj0_palette = value;   break;
-	case REG_OBJ1_PALETTE: ppu.obj1_palette = value;   break;
+	case REG_BG_PALETTE:   ppu_flush_lines(); ppu.bg_palette   = value; ppu.palettes_dirty = true; break;
+	case REG_OBJ0_PALETTE: ppu_flush_lines(); ppu.obj0_palette = value; ppu.palettes_dirty = true; break;
+	case REG_OBJ1_PALETTE: ppu_flush_lines(); ppu.obj1_palette = value; ppu.palettes_dirty = true; break;
 	case REG_WIN_SCROLL_Y: ppu.win_scroll_y = value;   break;
 	case REG_WIN_SCROLL_X: ppu.win_scroll_x = value;   break;
 	case REG_BG_PRAM_INDEX: ppu.bg_pram_index = value | 0x40; break;
 	case REG_BG_PRAM_DATA:
+		ppu_flush_lines();
 		ppu.bg_pram[ppu.bg_pram_index & 0x3F] = value;
+		ppu.palettes_dirty = true;
 		if (ppu.bg_pram_index & 0x80) {
 			if ((ppu.bg_pram_index & 0x3F) == 0x3F)
 				ppu.bg_pram_index &= 0xC0;
@@ -634,7 +1092,9 @@ void ppu_register_write(uint16_t address, uint8_t value) {
 		break;
 	case REG_SPRITE_PRAM_INDEX: ppu.sprite_pram_index = value | 0x40; break;
 	case REG_SPRITE_PRAM_DATA:
+		ppu_flush_lines();
 		ppu.sprite_pram[ppu.sprite_pram_index & 0x3F] = value;
+		ppu.palettes_dirty = true;
 		if (ppu.sprite_pram_index & 0x80) {
 			if ((ppu.sprite_pram_index & 0x3F) == 0x3F)
 				ppu.sprite_pram_index &= 0xC0;
@@ -672,6 +1132,35 @@ uint8_t ppu_vram_read(uint16_t address) {
 	return vram[address];
 }
 
+// Whether VRAM can be written to for the next few cycles without the PPU
+// changing modes in between
+bool ppu_vram_writable_for(unsigned cycles) {
+	if (!ppu.enabled)
+		return true;
+	if (ppu.mode == PIXEL_DRAW)
+		return false;
+
+	unsigned scanline_cycle = ppu.current_cycle % 456;
+	unsigned mode_end;
+	if (ppu.mode == VBLANK)
+		mode_end = 70224 - ppu.current_cycle;
+	else if (ppu.mode == OAM_SCAN)
+		mode_end = 80 - scanline_cycle;
+	else
+		mode_end = 456 - scanline_cycle;
+	return mode_end > cycles;
+}
+
+void ppu_vram_write_block(uint16_t address, const uint8_t *data, unsigned length) {
+	uint8_t *vram;
+	if (ppu.vram_bank)
+		vram = (uint8_t *)ppu.tile_data2;
+	else
+		vram = (uint8_t *)ppu.tile_data;
+	ppu_flush_lines();
+	memcpy(vram + address, data, length);
+}
+
 void ppu_vram_write(uint16_t address, uint8_t value) {
 	if (ppu.enabled && ppu.mode == PIXEL_DRAW)
 		return;
@@ -680,11 +1169,63 @@ void ppu_vram_write(uint16_t address, uint8_t value) {
 		vram = (uint8_t *)ppu.tile_data2;
 	else
 		vram = (uint8_t *)ppu.tile_data;
+	ppu_flush_lines();
 	vram[address] = value;
 }
 
+// Sets or clears the sprite's bit on every line that it covers
+static void sprite_bucket_update(int sprite_index, bool covers) {
+	int top    = (int)ppu.sprites[sprite_index].y_position - 16;
+	int bottom = top + (ppu.use_tall_sprites ? 16 : 8);
+	uint64_t bit = (uint64_t)1 << sprite_index;
+
+	if (top < 0)
+		top = 0;
+	if (bottom > 144)
+		bottom = 144;
+
+	for (int line = top; line < bottom; line++) {
+		if (covers)
+			ppu.line_sprites[line] |= bit;
+		else
+			ppu.line_sprites[line] &= ~bit;
+	}
+}
+
+static void sprite_buckets_rebuild(void) {
+	memset(ppu.line_sprites, 0, sizeof(ppu.line_sprites));
+	for (int i = 0; i < OAM_SPRITE_COUNT; i++)
+		sprite_bucket_update(i, true);
+}
+
+static inline void oam_store(uint16_t address, uint8_t value) {
+	uint8_t *oam = (uint8_t *)ppu.sprites;
+	ppu_flush_lines();
+	// Only the Y position decides which lines a sprite is on
+	if (address % 4 == 0 && oam[address] != value) {
+		sprite_bucket_update(address / 4, false);
+		oam[address] = value;
+		sprite_bucket_update(address / 4, true);
+		return;
+	}
+	oam[address] = value;
+}
+
 void ppu_oam_write_nonblocking(uint16_t address, uint8_t value) {
-	((uint8_t *)ppu.sprites)[address] = value;
+	oam_store(address, value);
+}
+
+void ppu_oam_write_block(uint16_t address, const uint8_t *data, unsigned length) {
+	uint8_t *oam = (uint8_t *)ppu.sprites;
+	int first = address / 4;
+	int last  = (address + length - 1) / 4;
+
+	ppu_flush_lines();
+	for (int i = first; i <= last; i++)
+		sprite_bucket_update(i, false);
+	memcpy(oam + address, data, length);
+	for (int i = first; i <= last; i++)
+		sprite_bucket_update(i, true);
 }
 
 uint8_t ppu_oam_read(uint16_t address) {
@@ -696,5 +1237,5 @@ uint8_t ppu_oam_read(uint16_t address) {
 void ppu_oam_write(uint16_t address, uint8_t value) {
 	if (ppu.enabled && (ppu.mode == PIXEL_DRAW || ppu.mode == OAM_SCAN))
 		return;
-	((uint8_t *)ppu.sprites)[address] = value;
+	oam_store(address, value);
 }
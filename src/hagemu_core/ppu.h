@@ -2,14 +2,28 @@
 #define PPU_H
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "core_types.h"
 
 void ppu_set_model(enum GBModel model);
 
 void ppu_tick(void);
 const uint32_t* ppu_get_frame(void);
+const uint8_t *ppu_get_frame_data(size_t *out_size);
+size_t ppu_get_frame_size(enum HagemuPixelFormat format);
+bool ppu_set_pixel_format(enum HagemuPixelFormat format);
+enum HagemuPixelFormat ppu_get_pixel_format(void);
+bool ppu_set_frame_slots(uint8_t *const *slots, unsigned slot_count);
+unsigned ppu_get_latest_frame_slot(unsigned *out_sequence);
+unsigned ppu_get_frame_sequence(unsigned slot);
+unsigned ppu_copy_frame_slot(unsigned slot, uint8_t *destination);
+void ppu_set_deferred_rendering(bool deferred);
 int ppu_get_current_line(void);
 unsigned ppu_get_frame_count(void);
+uint64_t ppu_get_frame_hash(uint64_t *out_audio_hash);
+// Fills rows (up to 144) with the changes since the last clear
+unsigned ppu_get_dirty_rows(struct HagemuDirtyRow *rows);
+void ppu_clear_dirty_rows(void);
 void ppu_reset(void);
 
 uint8_t ppu_vram_read(uint16_t address);
@@ -21,6 +35,10 @@ void ppu_oam_write(uint16_t address, uint8_t value);
 void ppu_register_write(uint16_t address, uint8_t value);
 // This is for the DMA, which has priority over the PPU at all times
 void ppu_oam_write_nonblocking(uint16_t address, uint8_t value);
+void ppu_oam_write_block(uint16_t address, const uint8_t *data, unsigned length);
+// For the HDMA, which has to check that VRAM stays writable for the block
+bool ppu_vram_writable_for(unsigned cycles);
+void ppu_vram_write_block(uint16_t address, const uint8_t *data, unsigned length);
 
 void ppu_set_vram_bank(bool vram_bank);
 bool ppu_get_vram_bank(void);
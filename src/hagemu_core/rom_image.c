@@ -0,0 +1,191 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define ROM_IMAGE_MMAP
+#endif
+
+#include "rom_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+#ifdef ROM_IMAGE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct HagemuRomImage {
+	const uint8_t *data;
+	size_t   size;
+	uint64_t hash;
+	unsigned references;
+	bool     mapped; // Otherwise the data was allocated
+
+	// A mapped file is found again by its identity instead of its contents,
+	// so that opening it doesn't have to read the whole file
+	uint64_t file_device;
+	uint64_t file_inode;
+
+	struct HagemuRomImage *next;
+};
+
+// Every image that's still in use
+static struct HagemuRomImage *images = NULL;
+
+static struct HagemuRomImage *rom_image_add(const uint8_t *data, size_t size, uint64_t hash) {
+	struct HagemuRomImage *image = calloc(1, sizeof(struct HagemuRomImage));
+	if (image == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the rom image\n");
+		return NULL;
+	}
+	image->data = data;
+	image->size = size;
+	image->hash = hash;
+	image->references = 1;
+	image->next = images;
+	images = image;
+	return image;
+}
+
+static struct HagemuRomImage *rom_image_find(const uint8_t *data, size_t size, uint64_t hash) {
+	for (struct HagemuRomImage *image = images; image != NULL; image = image->next) {
+		if (image->mapped || image->size != size || image->hash != hash)
+			continue;
+		if (memcmp(image->data, data, size) == 0) {
+			image->references++;
+			return image;
+		}
+	}
+	return NULL;
+}
+
+struct HagemuRomImage *rom_image_share(const uint8_t *data, size_t size) {
+	uint64_t hash = hash_bytes(HASH_SEED, data, size);
+	struct HagemuRomImage *image = rom_image_find(data, size, hash);
+	if (image != NULL) {
+		printf("Sharing the rom data that's already loaded\n");
+		return image;
+	}
+
+	printf("Allocating space and copying the rom data\n");
+	uint8_t *copy = malloc(size);
+	if (copy == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate the rom data\n");
+		return NULL;
+	}
+	memcpy(copy, data, size);
+
+	image = rom_image_add(copy, size, hash);
+	if (image == NULL)
+		free(copy);
+	return image;
+}
+
+// Used when the file can't be mapped
+static struct HagemuRomImage *rom_image_read_file(const char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open file '%s'\n", filename);
+		return NULL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t *data = (size > 0) ? malloc(size) : NULL;
+	if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "[ERROR] Unable to read file '%s'\n", filename);
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+
+	struct HagemuRomImage *image = rom_image_share(data, size);
+	free(data);
+	return image;
+}
+
+struct HagemuRomImage *rom_image_open(const char *filename) {
+#ifdef ROM_IMAGE_MMAP
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "[ERROR] Unable to open file '%s'\n", filename);
+		return NULL;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+		fprintf(stderr, "[ERROR] Unable to read file '%s'\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	for (struct HagemuRomImage *image = images; image != NULL; image = image->next) {
+		if (image->mapped
+		    && image->file_device == (uint64_t)info.st_dev
+		    && image->file_inode  == (uint64_t)info.st_ino
+		    && image->size == (size_t)info.st_size) {
+			close(fd);
+			image->references++;
+			printf("Sharing the rom file that's already mapped\n");
+			return image;
+		}
+	}
+
+	// Every process that maps the same file shares the same pages. The file
+	// shouldn't be changed while it's mapped.
+	void *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data != MAP_FAILED) {
+		struct HagemuRomImage *image = rom_image_add(data, info.st_size, 0);
+		if (image == NULL) {
+			munmap(data, info.st_size);
+			return NULL;
+		}
+		image->mapped = true;
+		image->file_device = info.st_dev;
+		image->file_inode  = info.st_ino;
+		printf("Mapped the rom file into memory\n");
+		return image;
+	}
+	printf("Unable to map the rom file. Reading it instead...\n");
+#endif
+	return rom_image_read_file(filename);
+}
+
+void rom_image_retain(struct HagemuRomImage *image) {
+	image->references++;
+}
+
+void rom_image_release(struct HagemuRomImage *image) {
+	if (image == NULL || --image->references > 0)
+		return;
+
+	for (struct HagemuRomImage **link = &images; *link != NULL; link = &(*link)->next) {
+		if (*link == image) {
+			*link = image->next;
+			break;
+		}
+	}
+
+#ifdef ROM_IMAGE_MMAP
+	if (image->mapped)
+		munmap((void *)image->data, image->size);
+	else
+		free((void *)image->data);
+#else
+	free((void *)image->data);
+#endif
+	free(image);
+}
+
+const uint8_t *rom_image_data(const struct HagemuRomImage *image) {
+	return image->data;
+}
+
+size_t rom_image_size(const struct HagemuRomImage *image) {
+	return image->size;
+}
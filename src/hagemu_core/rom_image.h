@@ -0,0 +1,22 @@
+#ifndef HAGEMU_ROM_IMAGE_H
+#define HAGEMU_ROM_IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A read-only ROM that can be shared by everything running the same game.
+// Each image is reference counted and only freed once nothing uses it.
+struct HagemuRomImage;
+
+// Maps the file if the platform can, otherwise reads it into memory
+struct HagemuRomImage *rom_image_open(const char *filename);
+// Copies the data, unless an image with the same contents already exists
+struct HagemuRomImage *rom_image_share(const uint8_t *data, size_t size);
+void rom_image_retain(struct HagemuRomImage *image);
+void rom_image_release(struct HagemuRomImage *image);
+
+const uint8_t *rom_image_data(const struct HagemuRomImage *image);
+size_t rom_image_size(const struct HagemuRomImage *image);
+
+#endif
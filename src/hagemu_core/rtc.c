@@ -14,6 +14,7 @@ struct RTCRegisters {
 
 struct RTC {
 	int64_t last_time;
+	bool    has_time; // Otherwise last_time hasn't been set yet
 	uint8_t rtc_serialized[RTC_SERIALIZED_SIZE];
 	bool    is_latched;
 	struct RTCRegisters regs;
@@ -22,14 +23,38 @@ struct RTC {
 
 struct RTC rtc = { .regs.control = 0x40 };
 
+// Where the time comes from. Unlike the registers, this survives resets.
+struct RTCClock {
+	enum HagemuClockSource source;
+	HagemuClockCallback callback;
+	void *userdata;
+	uint64_t cycles;     // Emulated at the normal speed clock rate
+	int64_t wall_offset; // Turns emulated seconds into a unix time for saves
+};
+
+struct RTCClock rtc_clock = { .source = CLOCK_SOURCE_WALL };
+
+// In seconds
+static int64_t rtc_now(void) {
+	switch (rtc_clock.source) {
+	case CLOCK_SOURCE_EMULATED: return rtc_clock.cycles / RTC_CYCLES_PER_SECOND;
+	case CLOCK_SOURCE_CALLBACK: return rtc_clock.callback(rtc_clock.userdata);
+	default:                    return time(NULL);
+	}
+}
+
 static void rtc_update_regs(void) {
-	if (!rtc.last_time || rtc.regs.control & 0x40) {
-		rtc.last_time = time(NULL);
+	int64_t new_time = rtc_now();
+	if (!rtc.has_time || rtc.regs.control & 0x40) {
+		rtc.last_time = new_time;
+		rtc.has_time = true;
 		return;
 	}
 
-	int64_t new_time = time(NULL);
+	// A clock that went backwards just stops until it catches up
 	int64_t delta_time = new_time - rtc.last_time;
+	if (delta_time <= 0)
+		return;
 
 	delta_time += rtc.regs.seconds;
 	rtc.regs.seconds = delta_time % 60;
@@ -76,7 +101,8 @@ void rtc_write_register(uint8_t index, uint8_t value) {
 		fprintf(stderr, "[ERROR] Undefined RTC register %02X\n", index);
 		exit(EXIT_FAILURE);
 	}
-	rtc.last_time = time(NULL);
+	rtc.last_time = rtc_now();
+	rtc.has_time = true;
 }
 
 uint8_t rtc_read_register(uint8_t index) {
@@ -111,7 +137,7 @@ const uint8_t *rtc_serialize(size_t *out_size) {
 	rtc.rtc_serialized[32] = rtc.latched_regs.days;
 	rtc.rtc_serialized[36] = rtc.latched_regs.control;
 
-	int64_t unix_time = time(NULL);
+	int64_t unix_time = rtc.last_time + rtc_clock.wall_offset;
 	for (int i = 0; i < 8; i++) {
 		rtc.rtc_serialized[40+i] = unix_time & 0xFF;
 		unix_time >>= 8;
@@ -143,5 +169,53 @@ void rtc_deserialize(const uint8_t *data, size_t size) {
 	rtc.last_time = 0;
 	for (int i = 0; i < 8; i++)
 		rtc.last_time |= (uint64_t)data[40+i] << (i * 8);
+	rtc.has_time = (rtc.last_time != 0);
+
+	// The emulated clock only runs with the emulator, so the time spent
+	// closed doesn't count
+	if (rtc_clock.source == CLOCK_SOURCE_EMULATED) {
+		rtc.last_time = rtc_now();
+		rtc.has_time = true;
+	}
 	rtc_update_regs();
 }
+
+// Has to come after counting the registers up to now with the old clock,
+// so the new one carries on from the same registers
+static void rtc_rebase(void) {
+	if (rtc_clock.source == CLOCK_SOURCE_EMULATED)
+		rtc_clock.wall_offset = time(NULL) - rtc_now();
+	else
+		rtc_clock.wall_offset = 0;
+	rtc.last_time = rtc_now();
+}
+
+void rtc_set_clock(enum HagemuClockSource source, HagemuClockCallback callback, void *userdata) {
+	if (source == CLOCK_SOURCE_CALLBACK && callback == NULL) {
+		fprintf(stderr, "[ERROR] The RTC needs a callback to use as its clock\n");
+		return;
+	}
+	rtc_update_regs();
+	rtc_clock.source   = source;
+	rtc_clock.callback = callback;
+	rtc_clock.userdata = userdata;
+	rtc_rebase();
+}
+
+void rtc_get_clock(enum HagemuClockSource *out_source, HagemuClockCallback *out_callback, void **out_userdata) {
+	*out_source   = rtc_clock.source;
+	*out_callback = rtc_clock.callback;
+	*out_userdata = rtc_clock.userdata;
+}
+
+// The emulated clock starts over with the rest of the GameBoy, so runs from
+// a reset always see the seconds tick at the same cycles
+void rtc_reset_clock(void) {
+	rtc_update_regs();
+	rtc_clock.cycles = 0;
+	rtc_rebase();
+}
+
+void rtc_add_cycles(unsigned cycles) {
+	rtc_clock.cycles += cycles;
+}
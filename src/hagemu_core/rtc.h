@@ -4,14 +4,21 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include "core_types.h"
 
 #define RTC_SERIALIZED_SIZE 48
+#define RTC_CYCLES_PER_SECOND (1 << 22)
 
 void rtc_write_register(uint8_t index, uint8_t value);
 uint8_t rtc_read_register(uint8_t index);
 void rtc_set_latch(bool enabled);
 
 void rtc_reset(void);
+void rtc_set_clock(enum HagemuClockSource source, HagemuClockCallback callback, void *userdata);
+void rtc_get_clock(enum HagemuClockSource *out_source, HagemuClockCallback *out_callback, void **out_userdata);
+void rtc_reset_clock(void);
+// Cycles at the normal speed clock rate, even in double speed mode
+void rtc_add_cycles(unsigned cycles);
 const uint8_t *rtc_serialize(size_t *out_size);
 void rtc_deserialize(const uint8_t *data, size_t size);
 
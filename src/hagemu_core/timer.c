@@ -8,6 +8,8 @@
 #define TIMER_COUNTER 0xFF05
 #define TIMER_MODULO  0xFF06
 #define TIMER_CONTROL 0xFF07
+// Farthest the timer is allowed to fall behind when nothing is due
+#define TIMER_MAX_PENDING 0x10000
 
 struct HagemuTimer {
 	uint16_t time; // measured in t-cycles
@@ -20,8 +22,13 @@ struct HagemuTimer {
 	bool     double_speed_mode;
 	bool     overflow_pending;
 	bool     just_reloaded;
+	unsigned pending_cycles; // Cycles that haven't been run yet
+	unsigned next_event;     // Run the pending cycles once there are this many
 } timer = { 0 };
 
+static void timer_catch_up(void);
+static void timer_schedule(void);
+
 static void set_clock_select(void) {
 	uint8_t select = timer.timer_control_raw & 0x03;
 	timer.clock_select = 1;
@@ -57,6 +64,7 @@ static void maybe_increment(uint16_t old_time, uint16_t new_time) {
 }
 
 uint8_t timer_register_read(uint16_t address) {
+	timer_catch_up();
 	switch (address) {
 	case TIMER_DIVIDER: return timer.time >> 8;
 	case TIMER_COUNTER: return timer.counter;
@@ -69,22 +77,23 @@ uint8_t timer_register_read(uint16_t address) {
 }
 
 void timer_register_write(uint16_t address, uint8_t value) {
+	timer_catch_up();
 	switch(address) {
 	case TIMER_DIVIDER:
 		maybe_increment(timer.time, 0);
 		timer.time = 0;
-		return;
+		break;
 	case TIMER_COUNTER:
 		if (timer.just_reloaded)
-			return;
+			break;
 		timer.overflow_pending = false;
 		timer.counter = value;
-		return;
+		break;
 	case TIMER_MODULO:
 		timer.modulo = value;
 		if (timer.just_reloaded)
 			timer.counter = value;
-		return;
+		break;
 	case TIMER_CONTROL: {
 		bool old_signal = timer.enabled && (timer.time & timer.clock_select);
 		timer.timer_control_raw = value;
@@ -93,22 +102,26 @@ void timer_register_write(uint16_t address, uint8_t value) {
 		bool new_signal = timer.enabled && (timer.time & timer.clock_select);
 		if (old_signal && !new_signal)
 			timer_increment();
-		return;
+		break;
 	}
 	default:
 		fprintf(stderr, "[ERROR] Write to illegal timer address %04X\n", address);
 		exit(EXIT_FAILURE);
 	}
+	timer_schedule();
 }
 
 void timer_set_speed_mode(bool double_speed_mode) {
+	timer_catch_up();
 	timer.double_speed_mode = double_speed_mode;
 	maybe_increment(timer.time, 0);
 	timer.time = 0;
 	set_clock_select();
+	timer_schedule();
 }
 
-void timer_tick(int t_cycles) {
+// A single M-cycle, which is always 4 t-cycles
+static void timer_tick_once(void) {
 	timer.just_reloaded = false;
 	if (timer.overflow_pending) {
 		timer.overflow_pending = false;
@@ -116,10 +129,79 @@ void timer_tick(int t_cycles) {
 		timer.just_reloaded = true;
 		interrupt_raise(TIMER_INTERRUPT);
 	}
-	maybe_increment(timer.time, timer.time + t_cycles);
-	timer.time += t_cycles;
+	maybe_increment(timer.time, timer.time + 4);
+	timer.time += 4;
+}
+
+// The counter goes up on each falling edge of the selected bit of the time,
+// which is once every 2 * clock_select t-cycles
+static unsigned cycles_to_increment(unsigned increments) {
+	unsigned period = 2 * timer.clock_select;
+	return (period - timer.time % period) + (increments - 1) * period;
+}
+
+void timer_advance(unsigned cycles) {
+	while (cycles > 0) {
+		// The cycles right after an overflow are the only ones that need
+		// more than counting
+		if (timer.overflow_pending || timer.just_reloaded) {
+			timer_tick_once();
+			cycles -= 4;
+			continue;
+		}
+
+		if (!timer.enabled) {
+			timer.time += cycles;
+			return;
+		}
+
+		unsigned overflow_cycles = cycles_to_increment(0x100 - timer.counter);
+		if (overflow_cycles > cycles) {
+			unsigned period = 2 * timer.clock_select;
+			timer.counter += (timer.time % period + cycles) / period;
+			timer.time += cycles;
+			return;
+		}
+
+		timer.time += overflow_cycles;
+		timer.counter = 0x00;
+		timer.overflow_pending = true;
+		cycles -= overflow_cycles;
+	}
+}
+
+unsigned timer_next_event_cycle(void) {
+	if (timer.overflow_pending)
+		return 4;
+	if (!timer.enabled)
+		return TIMER_MAX_PENDING;
+
+	// The interrupt is raised on the M-cycle after the overflow
+	unsigned cycles = cycles_to_increment(0x100 - timer.counter) + 4;
+	return (cycles < TIMER_MAX_PENDING) ? cycles : TIMER_MAX_PENDING;
+}
+
+static void timer_schedule(void) {
+	timer.next_event = timer_next_event_cycle();
+}
+
+// Runs the cycles that have been put off. This has to happen before anything
+// reads or changes the timer.
+static void timer_catch_up(void) {
+	timer_advance(timer.pending_cycles);
+	timer.pending_cycles = 0;
+	timer_schedule();
+}
+
+// The cycles are only counted here, and run once the timer could raise an
+// interrupt or when the CPU accesses one of its registers
+void timer_tick(int t_cycles) {
+	timer.pending_cycles += t_cycles;
+	if (timer.pending_cycles >= timer.next_event)
+		timer_catch_up();
 }
 
 void timer_reset(void) {
 	memset(&timer, 0, sizeof(struct HagemuTimer));
+	timer_schedule();
 }
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 
 void timer_tick(int t_cycles);
+void timer_advance(unsigned cycles);
+unsigned timer_next_event_cycle(void);
 uint8_t timer_register_read(uint16_t address);
 void timer_register_write(uint16_t address, uint8_t value);
 void timer_set_speed_mode(bool double_speed_mode);
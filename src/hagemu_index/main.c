@@ -0,0 +1,410 @@
+// Builds a catalog of rom files that a launcher can load with a single read.
+//
+//   hagemu_index update <index file> <rom directory>...
+//   hagemu_index list <index file>
+//
+// Updating only reads the header of files that are new or whose size or
+// modification time changed. Everything else is copied from the old index.
+//
+// Index layout (all values are little endian):
+//   char     magic[4] ("HGIX")
+//   uint32_t version
+//   uint32_t entry_count
+//   For every entry, sorted by path:
+//     uint16_t path_length, then the path without a null terminator
+//     int64_t  modified_time (seconds)
+//     uint64_t file_size
+//     char     title[16]
+//     uint8_t  cgb_flag, cart_type, mbc, header_checksum
+//     uint16_t global_checksum
+//     uint32_t rom_size, ram_size
+//     uint8_t  flags (see the INDEX_FLAG values)
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "hagemu_core.h"
+
+#define INDEX_MAGIC   "HGIX"
+#define INDEX_VERSION 1
+#define INDEX_ENTRY_SIZE (8 + 8 + 16 + 4 + 2 + 4 + 4 + 1)
+
+enum IndexFlag {
+	INDEX_FLAG_SUPPORTED      = 1 << 0,
+	INDEX_FLAG_CHECKSUM_VALID = 1 << 1,
+	INDEX_FLAG_RAM            = 1 << 2,
+	INDEX_FLAG_BATTERY        = 1 << 3,
+	INDEX_FLAG_TIMER          = 1 << 4,
+	INDEX_FLAG_RUMBLE         = 1 << 5,
+};
+
+struct IndexEntry {
+	char    *path;
+	int64_t  modified_time;
+	uint64_t file_size;
+	struct HagemuRomHeader header;
+};
+
+struct Index {
+	struct IndexEntry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+static void put_u16(uint8_t *out, uint16_t value) {
+	out[0] = value;
+	out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+	put_u16(out, value);
+	put_u16(out + 2, value >> 16);
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+	put_u32(out, value);
+	put_u32(out + 4, value >> 32);
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+	return in[0] | (in[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+	return get_u16(in) | ((uint32_t)get_u16(in + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+	return get_u32(in) | ((uint64_t)get_u32(in + 4) << 32);
+}
+
+static struct IndexEntry *index_add(struct Index *index) {
+	if (index->count == index->capacity) {
+		size_t capacity = index->capacity ? 2 * index->capacity : 256;
+		struct IndexEntry *entries = realloc(index->entries, capacity * sizeof(struct IndexEntry));
+		if (entries == NULL) {
+			fprintf(stderr, "[ERROR] Failed to allocate memory for the index\n");
+			exit(EXIT_FAILURE);
+		}
+		index->entries  = entries;
+		index->capacity = capacity;
+	}
+	struct IndexEntry *entry = &index->entries[index->count++];
+	memset(entry, 0, sizeof(struct IndexEntry));
+	return entry;
+}
+
+static void index_free(struct Index *index) {
+	for (size_t i = 0; i < index->count; i++)
+		free(index->entries[i].path);
+	free(index->entries);
+	memset(index, 0, sizeof(struct Index));
+}
+
+static int index_compare(const void *a, const void *b) {
+	return strcmp(((const struct IndexEntry *)a)->path, ((const struct IndexEntry *)b)->path);
+}
+
+static struct IndexEntry *index_find(const struct Index *index, const char *path) {
+	struct IndexEntry key = { .path = (char *)path };
+	return bsearch(&key, index->entries, index->count, sizeof(struct IndexEntry), index_compare);
+}
+
+static uint8_t entry_flags(const struct HagemuRomHeader *header) {
+	return (header->supported      ? INDEX_FLAG_SUPPORTED      : 0)
+	     | (header->checksum_valid ? INDEX_FLAG_CHECKSUM_VALID : 0)
+	     | (header->has_ram        ? INDEX_FLAG_RAM            : 0)
+	     | (header->has_battery    ? INDEX_FLAG_BATTERY        : 0)
+	     | (header->has_timer      ? INDEX_FLAG_TIMER          : 0)
+	     | (header->has_rumble     ? INDEX_FLAG_RUMBLE         : 0);
+}
+
+// The whole file is read at once and then parsed from memory. A missing file
+// counts as an empty index.
+static bool index_load(struct Index *index, const char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL)
+		return true;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t *data = (size > 0) ? malloc(size) : NULL;
+	if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "[ERROR] Unable to read the index '%s'\n", filename);
+		free(data);
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+
+	if (size < 12 || memcmp(data, INDEX_MAGIC, 4) != 0 || get_u32(data + 4) != INDEX_VERSION) {
+		fprintf(stderr, "[ERROR] '%s' isn't an index of this version\n", filename);
+		free(data);
+		return false;
+	}
+
+	uint32_t count = get_u32(data + 8);
+	const uint8_t *in  = data + 12;
+	const uint8_t *end = data + size;
+	for (uint32_t i = 0; i < count; i++) {
+		if (end - in < 2 || end - in < 2 + get_u16(in) + INDEX_ENTRY_SIZE) {
+			fprintf(stderr, "[ERROR] The index '%s' is cut short\n", filename);
+			free(data);
+			return false;
+		}
+		uint16_t path_length = get_u16(in);
+		struct IndexEntry *entry = index_add(index);
+		entry->path = malloc(path_length + 1);
+		if (entry->path == NULL) {
+			fprintf(stderr, "[ERROR] Failed to allocate memory for the index\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(entry->path, in + 2, path_length);
+		entry->path[path_length] = '\0';
+		in += 2 + path_length;
+
+		struct HagemuRomHeader *header = &entry->header;
+		entry->modified_time = (int64_t)get_u64(in);
+		entry->file_size     = get_u64(in + 8);
+		memcpy(header->title, in + 16, 16);
+		header->cgb_flag        = in[32];
+		header->cart_type       = in[33];
+		header->mbc             = in[34];
+		header->header_checksum = in[35];
+		header->global_checksum = get_u16(in + 36);
+		header->rom_size        = get_u32(in + 38);
+		header->ram_size        = get_u32(in + 42);
+		uint8_t flags           = in[46];
+		header->supported       = flags & INDEX_FLAG_SUPPORTED;
+		header->checksum_valid  = flags & INDEX_FLAG_CHECKSUM_VALID;
+		header->has_ram         = flags & INDEX_FLAG_RAM;
+		header->has_battery     = flags & INDEX_FLAG_BATTERY;
+		header->has_timer       = flags & INDEX_FLAG_TIMER;
+		header->has_rumble      = flags & INDEX_FLAG_RUMBLE;
+		in += INDEX_ENTRY_SIZE;
+	}
+	free(data);
+
+	// Older indexes are already sorted, but it's cheap to make sure
+	qsort(index->entries, index->count, sizeof(struct IndexEntry), index_compare);
+	return true;
+}
+
+// Written next to the old index first, so a reader never sees half of it
+static bool index_save(const struct Index *index, const char *filename) {
+	size_t size = 12;
+	for (size_t i = 0; i < index->count; i++)
+		size += 2 + strlen(index->entries[i].path) + INDEX_ENTRY_SIZE;
+
+	uint8_t *data = malloc(size);
+	if (data == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the index\n");
+		return false;
+	}
+	memcpy(data, INDEX_MAGIC, 4);
+	put_u32(data + 4, INDEX_VERSION);
+	put_u32(data + 8, index->count);
+
+	uint8_t *out = data + 12;
+	for (size_t i = 0; i < index->count; i++) {
+		const struct IndexEntry *entry = &index->entries[i];
+		const struct HagemuRomHeader *header = &entry->header;
+		size_t path_length = strlen(entry->path);
+		put_u16(out, path_length);
+		memcpy(out + 2, entry->path, path_length);
+		out += 2 + path_length;
+
+		put_u64(out, (uint64_t)entry->modified_time);
+		put_u64(out + 8, entry->file_size);
+		memcpy(out + 16, header->title, 16);
+		out[32] = header->cgb_flag;
+		out[33] = header->cart_type;
+		out[34] = header->mbc;
+		out[35] = header->header_checksum;
+		put_u16(out + 36, header->global_checksum);
+		put_u32(out + 38, header->rom_size);
+		put_u32(out + 42, header->ram_size);
+		out[46] = entry_flags(header);
+		out += INDEX_ENTRY_SIZE;
+	}
+
+	size_t name_length = strlen(filename);
+	char *temporary = malloc(name_length + 5);
+	if (temporary == NULL) {
+		fprintf(stderr, "[ERROR] Failed to allocate memory for the index\n");
+		free(data);
+		return false;
+	}
+	memcpy(temporary, filename, name_length);
+	memcpy(temporary + name_length, ".tmp", 5);
+
+	FILE *file = fopen(temporary, "wb");
+	bool written = file != NULL && fwrite(data, 1, size, file) == size;
+	if (file != NULL && fclose(file) != 0)
+		written = false;
+	if (!written || rename(temporary, filename) != 0) {
+		fprintf(stderr, "[ERROR] Unable to write the index '%s'\n", filename);
+		remove(temporary);
+		written = false;
+	}
+	free(temporary);
+	free(data);
+	return written;
+}
+
+static bool is_rom_filename(const char *name) {
+	const char *extension = strrchr(name, '.');
+	return extension != NULL
+	    && (strcmp(extension, ".gb") == 0 || strcmp(extension, ".gbc") == 0
+	     || strcmp(extension, ".GB") == 0 || strcmp(extension, ".GBC") == 0);
+}
+
+// Only the first HAGEMU_HEADER_SIZE bytes of the rom are read
+static bool read_header(const char *path, struct HagemuRomHeader *header) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	uint8_t data[HAGEMU_HEADER_SIZE];
+	size_t size = fread(data, 1, sizeof(data), file);
+	fclose(file);
+	return hagemu_parse_header(data, size, header);
+}
+
+struct IndexUpdate {
+	const struct Index *old_index;
+	struct Index new_index;
+	unsigned reused;
+	unsigned changed;
+	unsigned added;
+};
+
+static void index_scan(struct IndexUpdate *update, const char *directory) {
+	DIR *dir = opendir(directory);
+	if (dir == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open the directory '%s'\n", directory);
+		return;
+	}
+
+	struct dirent *item;
+	while ((item = readdir(dir)) != NULL) {
+		if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+			continue;
+
+		size_t directory_length = strlen(directory);
+		size_t name_length = strlen(item->d_name);
+		size_t path_length = directory_length + 1 + name_length;
+		if (path_length > UINT16_MAX)
+			continue;
+		char *path = malloc(path_length + 1);
+		if (path == NULL) {
+			fprintf(stderr, "[ERROR] Failed to allocate memory for the index\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(path, directory, directory_length);
+		path[directory_length] = '/';
+		memcpy(path + directory_length + 1, item->d_name, name_length + 1);
+
+		struct stat info;
+		if (stat(path, &info) != 0) {
+			free(path);
+			continue;
+		}
+		if (S_ISDIR(info.st_mode)) {
+			index_scan(update, path);
+			free(path);
+			continue;
+		}
+		if (!S_ISREG(info.st_mode) || !is_rom_filename(item->d_name)) {
+			free(path);
+			continue;
+		}
+
+		struct IndexEntry *old_entry = index_find(update->old_index, path);
+		if (old_entry != NULL
+		    && old_entry->modified_time == (int64_t)info.st_mtime
+		    && old_entry->file_size == (uint64_t)info.st_size) {
+			struct IndexEntry *entry = index_add(&update->new_index);
+			*entry = *old_entry;
+			entry->path = path;
+			update->reused++;
+			continue;
+		}
+
+		struct HagemuRomHeader header;
+		if (!read_header(path, &header)) {
+			printf("Skipping '%s', it's too small to be a rom\n", path);
+			free(path);
+			continue;
+		}
+		if (old_entry != NULL)
+			update->changed++;
+		else
+			update->added++;
+
+		struct IndexEntry *entry = index_add(&update->new_index);
+		entry->path = path;
+		entry->modified_time = info.st_mtime;
+		entry->file_size = info.st_size;
+		entry->header = header;
+	}
+	closedir(dir);
+}
+
+static int index_update(const char *filename, char **directories, int directory_count) {
+	struct Index old_index = { 0 };
+	if (!index_load(&old_index, filename))
+		return EXIT_FAILURE;
+
+	struct IndexUpdate update = { .old_index = &old_index };
+	for (int i = 0; i < directory_count; i++)
+		index_scan(&update, directories[i]);
+	qsort(update.new_index.entries, update.new_index.count, sizeof(struct IndexEntry), index_compare);
+
+	unsigned kept = update.reused + update.changed;
+	unsigned removed = (old_index.count > kept) ? old_index.count - kept : 0;
+	printf("Indexed %zu roms: %u unchanged, %u changed, %u added, %u removed\n",
+	       update.new_index.count, update.reused, update.changed, update.added, removed);
+
+	bool saved = index_save(&update.new_index, filename);
+	index_free(&update.new_index);
+	index_free(&old_index);
+	return saved ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int index_list(const char *filename) {
+	struct Index index = { 0 };
+	if (!index_load(&index, filename))
+		return EXIT_FAILURE;
+
+	for (size_t i = 0; i < index.count; i++) {
+		const struct IndexEntry *entry = &index.entries[i];
+		const struct HagemuRomHeader *header = &entry->header;
+		const char *color = (header->cgb_flag == 0xC0) ? "GBC"
+		                  : (header->cgb_flag == 0x80) ? "GB+GBC" : "GB";
+		printf("%-16s %-6s MBC%-2u %5u KiB ROM %4u KiB RAM%s%s%s %s\n",
+		       header->title, color, header->mbc,
+		       header->rom_size / 1024, header->ram_size / 1024,
+		       header->has_battery    ? " battery" : "",
+		       header->has_timer      ? " rtc" : "",
+		       header->supported      ? "" : " (unsupported)",
+		       entry->path);
+	}
+	index_free(&index);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc >= 4 && strcmp(argv[1], "update") == 0)
+		return index_update(argv[2], argv + 3, argc - 3);
+	if (argc == 3 && strcmp(argv[1], "list") == 0)
+		return index_list(argv[2]);
+
+	fprintf(stderr, "Usage: %s update <index file> <rom directory>...\n", argv[0]);
+	fprintf(stderr, "       %s list <index file>\n", argv[0]);
+	return EXIT_FAILURE;
+}
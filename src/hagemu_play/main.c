@@ -0,0 +1,73 @@
+// Plays an input movie without a window or audio, as fast as the core runs.
+//
+//   hagemu_play [--frames count] <rom file> <movie file>
+//
+// Prints how long it took and the hash of the last frame, so the same movie
+// doubles as a benchmark and as a check that the core still plays the game
+// out the same. Exits with a failure if any keyframe didn't match.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hagemu_core.h"
+
+#define GB_FRAMES_PER_SECOND 59.7275
+
+int main(int argc, char *argv[]) {
+	const char *rom_filename = NULL;
+	const char *movie_filename = NULL;
+	unsigned max_frames = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			max_frames = strtoul(argv[++i], NULL, 10);
+		} else if (rom_filename == NULL) {
+			rom_filename = argv[i];
+		} else if (movie_filename == NULL) {
+			movie_filename = argv[i];
+		} else {
+			rom_filename = NULL;
+			break;
+		}
+	}
+	if (rom_filename == NULL || movie_filename == NULL) {
+		fprintf(stderr, "Usage: %s [--frames count] <rom file> <movie file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct HagemuRomImage *rom = hagemu_rom_open(rom_filename);
+	if (!rom)
+		return EXIT_FAILURE;
+	struct HagemuGB *gb = hagemu_create();
+	hagemu_set_rom_image(gb, MODEL_DMG, rom);
+	hagemu_rom_release(rom);
+	if (!hagemu_movie_play(gb, movie_filename)) {
+		hagemu_destroy(gb);
+		return EXIT_FAILURE;
+	}
+
+	// Nothing reads the audio, so only keep a little of it around
+	hagemu_set_audio_capacity(1024);
+
+	struct HagemuMovieInfo info;
+	clock_t start = clock();
+	do {
+		hagemu_run_frame(gb);
+		hagemu_movie_get_info(&info);
+	} while (info.state == MOVIE_STATE_PLAYING && (max_frames == 0 || info.frames < max_frames));
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	hagemu_movie_stop();
+
+	double game_seconds = info.frames / GB_FRAMES_PER_SECOND;
+	printf("Played %u frames (%.1f seconds of game time) in %.3f seconds\n", info.frames, game_seconds, seconds);
+	if (seconds > 0)
+		printf("%.0f frames per second, %.1fx real time\n", info.frames / seconds, game_seconds / seconds);
+	printf("Checked %u keyframes, %u didn't match", info.keyframes, info.desyncs);
+	if (info.desyncs > 0)
+		printf(" starting at frame %u", info.first_desync_frame);
+	printf("\nThe APU ran %.1f ticks at a time on average", hagemu_audio_average_skip());
+	printf("\nLast frame hash: %016llx\n", (unsigned long long)hagemu_get_frame_hash(NULL));
+
+	hagemu_destroy(gb);
+	return info.desyncs > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}